@@ -1,9 +1,40 @@
+#include <algorithm>
+#include <atomic>
 #include <boost/program_options.hpp>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <complex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
@@ -12,6 +43,43 @@
 #define DEFAULT_SIGMA_SPACE 2.0
 #define DEFAULT_ALGORITHM "gaussian"
 
+#define FFT_MIN_TILE 64
+#define FFT_TRANSFORM_COST 16
+
+#define KERNEL_RANK_TOLERANCE 1e-3
+#define SEPARABLE_TERM_COST 32
+#define KERNEL_MAGIC "KRNL"
+
+#define MASK_TILE 64
+
+#define FIXED_SHIFT 14
+
+#define BLUE_NOISE_SIZE 64
+
+#define SRGB_ENCODE_STEPS 8192
+
+#define STREAM_BAND_ROWS 64
+
+#define PYRAMID_MIN_STRENGTH 128
+#define PYRAMID_LEVEL_STRENGTH 32
+
+#define RAW_MAGIC "BLRI"
+
+#define DEFAULT_COMPRESSION 8
+#define DEFLATE_PIECE_SIZE (256 * 1024)
+#define ADLER_BASE 65521u
+
+#define DEFAULT_QUALITY 100
+#define REDUCE_MIN_STRENGTH 16
+
+#define DEFAULT_QUEUE_DEPTH 2
+
+#define SERVE_MAX_LINE 4096
+#define SERVE_BATCH_BYTES (256 * 1024)
+#define SERVE_LATENCY_BUCKETS 18
+#define SERVE_MAX_INPUT_BYTES (1024 * 1024 * 1024)
+#define SERVE_MAX_CLIENTS 64
+
 #include "stb_image.h"
 #include "stb_image_write.h"
 
@@ -40,9 +108,71 @@ pad_image(const std::vector<std::vector<std::vector<float>>> &image, int pad_h,
   return padded;
 }
 
+void fft(std::vector<std::complex<float>> &a, bool invert) {
+  int n = a.size();
+
+  for (int i = 1, j = 0; i < n; ++i) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j)
+      std::swap(a[i], a[j]);
+  }
+
+  for (int len = 2; len <= n; len <<= 1) {
+    double angle = 2 * M_PI / len * (invert ? 1 : -1);
+    std::complex<float> wlen(std::cos(angle), std::sin(angle));
+    for (int i = 0; i < n; i += len) {
+      std::complex<float> w(1);
+      for (int j = 0; j < len / 2; ++j) {
+        std::complex<float> u = a[i + j];
+        std::complex<float> v = a[i + j + len / 2] * w;
+        a[i + j] = u + v;
+        a[i + j + len / 2] = u - v;
+        w *= wlen;
+      }
+    }
+  }
+
+  if (invert) {
+    for (auto &x : a)
+      x /= n;
+  }
+}
+
+void fft_2d(std::vector<std::complex<float>> &a, int rows, int cols, bool invert) {
+  std::vector<std::complex<float>> line(cols);
+  for (int i = 0; i < rows; ++i) {
+    std::copy(a.begin() + i * cols, a.begin() + (i + 1) * cols, line.begin());
+    fft(line, invert);
+    std::copy(line.begin(), line.end(), a.begin() + i * cols);
+  }
+
+  line.resize(rows);
+  for (int j = 0; j < cols; ++j) {
+    for (int i = 0; i < rows; ++i)
+      line[i] = a[i * cols + j];
+    fft(line, invert);
+    for (int i = 0; i < rows; ++i)
+      a[i * cols + j] = line[i];
+  }
+}
+
+int next_pow2(int n) {
+  int p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+// Overlap-add FFT convolution. The clamp-padded image is cut into tiles that
+// are transformed one at a time, so scratch memory depends on the kernel size
+// rather than the image size. Two channels sharing a kernel are packed into
+// the real and imaginary parts of one transform.
 std::vector<std::vector<std::vector<float>>>
-conv(const std::vector<std::vector<std::vector<float>>> &image,
-     const std::vector<std::vector<std::vector<float>>> &kernel) {
+fft_conv(const std::vector<std::vector<std::vector<float>>> &image,
+         const std::vector<std::vector<std::vector<float>>> &kernel) {
   int Hi = image.size();
   int Wi = image[0].size();
   int channels = image[0][0].size();
@@ -52,37 +182,141 @@ conv(const std::vector<std::vector<std::vector<float>>> &image,
   std::vector<std::vector<std::vector<float>>> out(
       Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
 
+  int Nh = std::max(FFT_MIN_TILE, next_pow2(2 * Hk));
+  int Nw = std::max(FFT_MIN_TILE, next_pow2(2 * Wk));
+  int Th = Nh - Hk + 1;
+  int Tw = Nw - Wk + 1;
+  int padded_Hi = Hi + Hk - 1;
+  int padded_Wi = Wi + Wk - 1;
   int pad_h = Hk / 2;
   int pad_w = Wk / 2;
-  std::vector<std::vector<std::vector<float>>> padded =
-      pad_image(image, pad_h, pad_w);
+
+  bool shared_kernel = true;
+  for (int kh = 0; kh < Hk && shared_kernel; ++kh)
+    for (int kw = 0; kw < Wk && shared_kernel; ++kw)
+      for (int c = 1; c < channels; ++c)
+        if (kernel[kh][kw][c] != kernel[kh][kw][0])
+          shared_kernel = false;
+
+  std::vector<std::complex<float>> kernel_fft(Nh * Nw);
+  std::vector<std::complex<float>> tile(Nh * Nw);
+
+  for (int c = 0; c < channels;) {
+    int pair = (shared_kernel && c + 1 < channels) ? 2 : 1;
+
+    std::fill(kernel_fft.begin(), kernel_fft.end(), 0);
+    for (int kh = 0; kh < Hk; ++kh)
+      for (int kw = 0; kw < Wk; ++kw)
+        kernel_fft[kh * Nw + kw] = kernel[Hk - 1 - kh][Wk - 1 - kw][c];
+    fft_2d(kernel_fft, Nh, Nw, false);
+
+    for (int ty = 0; ty < padded_Hi; ty += Th) {
+      for (int tx = 0; tx < padded_Wi; tx += Tw) {
+        std::fill(tile.begin(), tile.end(), 0);
+        for (int y = 0; y < Th && ty + y < padded_Hi; ++y) {
+          int src_i = std::clamp(ty + y - pad_h, 0, Hi - 1);
+          for (int x = 0; x < Tw && tx + x < padded_Wi; ++x) {
+            int src_j = std::clamp(tx + x - pad_w, 0, Wi - 1);
+            float re = image[src_i][src_j][c];
+            float im = pair == 2 ? image[src_i][src_j][c + 1] : 0;
+            tile[y * Nw + x] = std::complex<float>(re, im);
+          }
+        }
+
+        fft_2d(tile, Nh, Nw, false);
+        for (int k = 0; k < Nh * Nw; ++k)
+          tile[k] *= kernel_fft[k];
+        fft_2d(tile, Nh, Nw, true);
+
+        for (int y = 0; y < Nh; ++y) {
+          int out_i = ty + y - (Hk - 1);
+          if (out_i < 0 || out_i >= Hi)
+            continue;
+          for (int x = 0; x < Nw; ++x) {
+            int out_j = tx + x - (Wk - 1);
+            if (out_j < 0 || out_j >= Wi)
+              continue;
+            out[out_i][out_j][c] += tile[y * Nw + x].real();
+            if (pair == 2)
+              out[out_i][out_j][c + 1] += tile[y * Nw + x].imag();
+          }
+        }
+      }
+    }
+
+    c += pair;
+  }
+
+  return out;
+}
+
+// Estimated cost of fft_conv() per output sample, in multiply-adds of direct
+// convolution: a forward and an inverse transform of each tile, N log N in
+// its size, spread over the outputs the tile produces and the two channels
+// it carries. FFT_TRANSFORM_COST was measured against separable passes and
+// direct convolution; conv() and custom_conv() both choose by this estimate.
+double fft_cost(int Hk, int Wk, int channels) {
+  int Nh = std::max(FFT_MIN_TILE, next_pow2(2 * Hk));
+  int Nw = std::max(FFT_MIN_TILE, next_pow2(2 * Wk));
+  double points = static_cast<double>(Nh) * Nw;
+  double outputs = static_cast<double>(Nh - Hk + 1) * (Nw - Wk + 1);
+  return FFT_TRANSFORM_COST * points * std::log2(points) / outputs / (channels > 1 ? 2 : 1);
+}
+
+// Direct convolution of the padded image. Channels is the channel count when
+// it is known at compile time (1, 3 or 4), which lets the per-channel sums
+// live in registers and the channel loop unroll; 0 handles any other count.
+template <int Channels>
+void conv_direct(const std::vector<std::vector<std::vector<float>>> &padded,
+                 const std::vector<std::vector<std::vector<float>>> &kernel,
+                 std::vector<std::vector<std::vector<float>>> &out) {
+  int Hi = out.size();
+  int Wi = out[0].size();
+  int channels = Channels ? Channels : out[0][0].size();
+  int Hk = kernel.size();
+  int Wk = kernel[0].size();
 
   for (int image_h = 0; image_h < Hi; ++image_h) {
     for (int image_w = 0; image_w < Wi; ++image_w) {
-      for (int c = 0; c < channels; ++c) {
-        float sum = 0;
+      if constexpr (Channels > 0) {
+        float sum[Channels] = {};
         for (int kh = 0; kh < Hk; ++kh) {
           for (int kw = 0; kw < Wk; ++kw) {
-            sum += kernel[kh][kw][c] * padded[image_h + kh][image_w + kw][c];
+            const auto &weights = kernel[kh][kw];
+            const auto &pixel = padded[image_h + kh][image_w + kw];
+            for (int c = 0; c < Channels; ++c)
+              sum[c] += weights[c] * pixel[c];
           }
         }
-        out[image_h][image_w][c] = sum;
+        for (int c = 0; c < Channels; ++c)
+          out[image_h][image_w][c] = sum[c];
+      } else {
+        for (int c = 0; c < channels; ++c) {
+          float sum = 0;
+          for (int kh = 0; kh < Hk; ++kh) {
+            for (int kw = 0; kw < Wk; ++kw) {
+              sum += kernel[kh][kw][c] * padded[image_h + kh][image_w + kw][c];
+            }
+          }
+          out[image_h][image_w][c] = sum;
+        }
       }
     }
   }
-
-  return out;
 }
 
 std::vector<std::vector<std::vector<float>>>
-bilateral_conv(const std::vector<std::vector<std::vector<float>>> &image,
-               const std::vector<std::vector<std::vector<float>>> &kernel, float sigma_range) {
+conv(const std::vector<std::vector<std::vector<float>>> &image,
+     const std::vector<std::vector<std::vector<float>>> &kernel) {
   int Hi = image.size();
   int Wi = image[0].size();
   int channels = image[0][0].size();
   int Hk = kernel.size();
   int Wk = kernel[0].size();
 
+  if (fft_cost(Hk, Wk, channels) < Hk * Wk)
+    return fft_conv(image, kernel);
+
   std::vector<std::vector<std::vector<float>>> out(
       Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
 
@@ -91,304 +325,4464 @@ bilateral_conv(const std::vector<std::vector<std::vector<float>>> &image,
   std::vector<std::vector<std::vector<float>>> padded =
       pad_image(image, pad_h, pad_w);
 
-  for (int image_h = 0; image_h < Hi; ++image_h) {
-    for (int image_w = 0; image_w < Wi; ++image_w) {
-      for (int c = 0; c < channels; ++c) {
-        float sum = 0;
-        float weight_sum = 0;
+  if (channels == 1)
+    conv_direct<1>(padded, kernel, out);
+  else if (channels == 3)
+    conv_direct<3>(padded, kernel, out);
+  else if (channels == 4)
+    conv_direct<4>(padded, kernel, out);
+  else
+    conv_direct<0>(padded, kernel, out);
 
-        for (int kh = 0; kh < Hk; ++kh) {
-          for (int kw = 0; kw < Wk; ++kw) {
-            float intensity_diff = image[image_h][image_w][c] - padded[image_h + kh][image_w + kw][c];
-            float range_gaussian = std::exp(-(intensity_diff * intensity_diff) / (2 * sigma_range * sigma_range));
+  return out;
+}
 
-            float weight = kernel[kh][kw][c] * range_gaussian;
-            sum += padded[image_h + kh][image_w + kw][c] * weight;
-            weight_sum += weight;
-          }
-        }
-        out[image_h][image_w][c] = sum / weight_sum;
-      }
-    }
+enum class storage_format { fp32, fp16, bf16 };
+
+struct float16 {
+  uint16_t bits;
+};
+
+struct bfloat16 {
+  uint16_t bits;
+};
+
+uint16_t float_to_half(float value) {
+  uint32_t x;
+  std::memcpy(&x, &value, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exponent = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  if (((x >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  if (exponent >= 31)
+    return sign | 0x7c00;
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t midpoint = 1u << (shift - 1);
+    if (rest > midpoint || (rest == midpoint && (half & 1)))
+      ++half;
+    return sign | half;
   }
 
-  return out;
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    ++half;
+  return half;
 }
 
-std::vector<std::vector<std::vector<float>>> box_kernel(int size, int channels) {
-  float value = 1.0f / (size * size);
+float half_to_float(uint16_t half) {
+  uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t x;
 
-  std::vector<std::vector<std::vector<float>>> kernel(
-      size,
-      std::vector<std::vector<float>>(size, std::vector<float>(channels, value))
-  );
+  if (exponent == 0 && mantissa == 0) {
+    x = sign;
+  } else if (exponent == 0) {
+    exponent = 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | ((exponent + 112) << 23) | ((mantissa & 0x3ff) << 13);
+  } else if (exponent == 31) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
 
-  return kernel;
+  float value;
+  std::memcpy(&value, &x, sizeof(value));
+  return value;
 }
 
-std::vector<std::vector<std::vector<float>>> gaussian_kernel(int size, int channels) {
-  std::vector<std::vector<std::vector<float>>> kernel(
-      size,
-      std::vector<std::vector<float>>(size, std::vector<float>(channels, 0))
-  );
-
-  double sigma = ((double)size / 2 > 1) ? (double)size / 2 : 1;
-  int k = (size - 1) / 2;
+// Row conversions between the float accumulators and the storage format of
+// the buffer between separable passes.
+void store_row(const float *src, float *dst, int n) {
+  std::copy(src, src + n, dst);
+}
 
-  double sum = 0.0;
+void load_row(const float *src, float *dst, int n) {
+  std::copy(src, src + n, dst);
+}
 
-  for (int i = 0; i < size; ++i) {
-    for (int j = 0; j < size; ++j) {
-      double exponent = -((std::pow(i - k, 2) + std::pow(j - k, 2)) / (2 * sigma * sigma));
-      float value = (1 / (2 * M_PI * sigma * sigma)) * std::exp(exponent);
+// fp16 rows are converted eight samples at a time with F16C where the CPU
+// has it, checked at run time so that the default build uses it too. Each
+// returns how many samples it converted; the scalar loop does the rest.
+#if defined(__x86_64__) || defined(__i386__)
+bool has_f16c() {
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+  }();
+  return supported;
+}
 
-      for (int c = 0; c < channels; ++c) {
-        kernel[i][j][c] = value;
-      }
-      sum += value;
-    }
+__attribute__((target("avx,f16c"))) int store_row_f16c(const float *src, float16 *dst, int n) {
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + x), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), half);
   }
+  return x;
+}
 
-  for (int i = 0; i < size; ++i) {
-    for (int j = 0; j < size; ++j) {
-      for (int c = 0; c < channels; ++c) {
-        kernel[i][j][c] /= sum;
-      }
-    }
+__attribute__((target("avx,f16c"))) int load_row_f16c(const float16 *src, float *dst, int n) {
+  int x = 0;
+  for (; x + 8 <= n; x += 8) {
+    __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+    _mm256_storeu_ps(dst + x, _mm256_cvtph_ps(half));
   }
+  return x;
+}
+#else
+bool has_f16c() { return false; }
 
-  return kernel;
+int store_row_f16c(const float *, float16 *, int) { return 0; }
+int load_row_f16c(const float16 *, float *, int) { return 0; }
+#endif
+
+void store_row(const float *src, float16 *dst, int n) {
+  int x = has_f16c() ? store_row_f16c(src, dst, n) : 0;
+  for (; x < n; ++x)
+    dst[x].bits = float_to_half(src[x]);
 }
 
-std::vector<std::vector<std::vector<float>>> bilateral_kernel(
-  const std::vector<std::vector<std::vector<float>>> &image, int size, float sigma_space, float sigma_range, int channels) {
+void load_row(const float16 *src, float *dst, int n) {
+  int x = has_f16c() ? load_row_f16c(src, dst, n) : 0;
+  for (; x < n; ++x)
+    dst[x] = half_to_float(src[x].bits);
+}
 
-  std::vector<std::vector<std::vector<float>>> kernel(
-      size,
-      std::vector<std::vector<float>>(size, std::vector<float>(channels, 0)));
+void store_row(const float *src, bfloat16 *dst, int n) {
+  for (int x = 0; x < n; ++x) {
+    uint32_t bits;
+    std::memcpy(&bits, &src[x], sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
+      dst[x].bits = 0x7fc0;
+    else
+      dst[x].bits = (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+  }
+}
 
-  int k = (size - 1) / 2;
+void load_row(const bfloat16 *src, float *dst, int n) {
+  for (int x = 0; x < n; ++x) {
+    uint32_t bits = static_cast<uint32_t>(src[x].bits) << 16;
+    std::memcpy(&dst[x], &bits, sizeof(bits));
+  }
+}
 
-  for (int i = 0; i < size; ++i) {
-    for (int j = 0; j < size; ++j) {
-      float spatial_gaussian = std::exp(-((i - k) * (i - k) + (j - k) * (j - k)) / (2 * sigma_space * sigma_space));
-      for (int c = 0; c < channels; ++c) {
-        kernel[i][j][c] = spatial_gaussian;
+enum class dither_mode { none, ordered, blue };
+
+// 8x8 Bayer matrix as offsets in [-0.5, 0.5) of one output step.
+std::vector<float> ordered_dither_pattern() {
+  const int n = 8;
+  std::vector<float> pattern(n * n);
+
+  for (int y = 0; y < n; ++y) {
+    for (int x = 0; x < n; ++x) {
+      int value = 0;
+      for (int bit = 0; bit < 3; ++bit) {
+        int shift = 2 * (2 - bit);
+        value |= ((((x ^ y) >> bit) & 1) << (shift + 1)) | (((y >> bit) & 1) << shift);
       }
+      pattern[y * n + x] = (value + 0.5f) / (n * n) - 0.5f;
     }
   }
 
-  return kernel;
+  return pattern;
 }
 
-std::vector<std::vector<std::vector<float>>>
-median_filter(const std::vector<std::vector<std::vector<float>>> &image, int kernel_size) {
-    int Hi = image.size();
-    int Wi = image[0].size();
-    int channels = image[0][0].size();
-    int pad_h = kernel_size / 2;
-    int pad_w = kernel_size / 2;
-    std::vector<std::vector<std::vector<float>>> out(
-        Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
-
-    std::vector<std::vector<std::vector<float>>> padded = pad_image(image, pad_h, pad_w);
+// Blue noise threshold map built by void filling: each rank goes to the pixel
+// with the lowest Gaussian-weighted density of the pixels ranked before it,
+// measured on a torus so the map tiles without seams.
+std::vector<float> blue_noise_pattern() {
+  const int n = BLUE_NOISE_SIZE;
+  const float sigma = 1.5f;
+  std::vector<float> falloff(n * n), energy(n * n, 0), pattern(n * n);
+  std::vector<bool> ranked(n * n, false);
 
-    for (int image_h = 0; image_h < Hi; ++image_h) {
-        for (int image_w = 0; image_w < Wi; ++image_w) {
-            for (int c = 0; c < channels; ++c) {
-                std::vector<float> neighborhood;
-                for (int kh = 0; kh < kernel_size; ++kh) {
-                    for (int kw = 0; kw < kernel_size; ++kw) {
-                        neighborhood.push_back(padded[image_h + kh][image_w + kw][c]);
-                    }
-                }
-                std::sort(neighborhood.begin(), neighborhood.end());
-                out[image_h][image_w][c] = neighborhood[neighborhood.size() / 2];
-            }
-        }
+  for (int y = 0; y < n; ++y) {
+    for (int x = 0; x < n; ++x) {
+      int dy = std::min(y, n - y), dx = std::min(x, n - x);
+      falloff[y * n + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
     }
+  }
 
-    return out;
-}
+  for (int rank = 0; rank < n * n; ++rank) {
+    int best = -1;
+    for (int i = 0; i < n * n; ++i)
+      if (!ranked[i] && (best < 0 || energy[i] < energy[best]))
+        best = i;
 
-std::vector<unsigned char>
-flatten_image(const std::vector<std::vector<std::vector<float>>> &image,
-              int width, int height, int channels) {
-  std::vector<unsigned char> flat_image(width * height * channels);
+    ranked[best] = true;
+    pattern[best] = (rank + 0.5f) / (n * n) - 0.5f;
 
-  for (int i = 0; i < height; ++i) {
-    for (int j = 0; j < width; ++j) {
-      for (int c = 0; c < channels; ++c) {
-        flat_image[(i * width + j) * channels + c] =
-            static_cast<unsigned char>(image[i][j][c]);
-      }
+    int by = best / n, bx = best % n;
+    for (int y = 0; y < n; ++y) {
+      int dy = (y - by + n) % n;
+      for (int x = 0; x < n; ++x)
+        energy[y * n + x] += falloff[dy * n + (x - bx + n) % n];
     }
   }
 
-  return flat_image;
+  return pattern;
 }
 
-std::vector<std::vector<std::vector<float>>> motion_kernel(int size, const std::string &direction, int channels) {
-    std::vector<std::vector<std::vector<float>>> kernel(size,
-        std::vector<std::vector<float>>(size, std::vector<float>(channels, 0)));
+std::vector<float> dither_pattern(dither_mode mode) {
+  if (mode == dither_mode::ordered)
+    return ordered_dither_pattern();
+  else if (mode == dither_mode::blue)
+    return blue_noise_pattern();
+  return {};
+}
 
-    float value = 1.0f / size;
+template <typename T> constexpr float sample_max() { return 255.0f; }
+template <> constexpr float sample_max<uint16_t>() { return 65535.0f; }
 
-    if (direction == "vertical") {
-        for (int i = 0; i < size; ++i) {
-            for (int c = 0; c < channels; ++c) {
-                kernel[i][0][c] = value;
-            }
-        }
-    } else if (direction == "horizontal") {
-        for (int j = 0; j < size; ++j) {
-            for (int c = 0; c < channels; ++c) {
-                kernel[0][j][c] = value;
-            }
-        }
-    } else if (direction == "diagonal") {
-        for (int i = 0; i < size; ++i) {
-            for (int j = 0; j < size; ++j) {
-                for (int c = 0; c < channels; ++c) {
-                    if (i == j) {
-                        kernel[i][j][c] = value;
-                    }
-                }
-            }
-        }
-    }
+float srgb_to_linear(float value) {
+  return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
 
-    return kernel;
+float linear_to_srgb(float value) {
+  return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1 / 2.4f) - 0.055f;
 }
 
-int main(int argc, char *argv[]) {
-  boost::program_options::options_description desc("Allowed options");
-  desc.add_options()
-      ("input,i", boost::program_options::value<std::string>(), "set input file name")
-      ("output,o", boost::program_options::value<std::string>(), "set output file name")
-      ("algo,a", boost::program_options::value<std::string>(), "set algorithm (default: gaussian)")
-      ("strength,s", boost::program_options::value<int>(), "set blur strength (default: 3)")
-      ("sigma_range,sr", boost::program_options::value<float>(), "set sigma range for bilateral blur (default: 50.0)")
-      ("sigma_space,sp", boost::program_options::value<float>(), "set sigma space for bilateral blur (default: 2.0)")
-      ("direction,d", boost::program_options::value<std::string>(), "set direction for motion blur")
-      ("help,h", "display usage message");
+// Linear-light value (0-255 scale) of every possible sample of type T.
+template <typename T>
+const std::vector<float> &srgb_decode_table() {
+  static const std::vector<float> table = [] {
+    std::vector<float> values(static_cast<size_t>(sample_max<T>()) + 1);
+    for (size_t i = 0; i < values.size(); ++i)
+      values[i] = srgb_to_linear(i / sample_max<T>()) * 255.0f;
+    return values;
+  }();
+  return table;
+}
 
-  if (argc == 1) {
-    std::cout << desc << "\n";
-    return 0;
-  }
+// linear_to_srgb() sampled at SRGB_ENCODE_STEPS points over 0-255, read back
+// with linear interpolation. The error stays well below one 16-bit step.
+const std::vector<float> &srgb_encode_table() {
+  static const std::vector<float> table = [] {
+    std::vector<float> values(SRGB_ENCODE_STEPS + 2);
+    for (int i = 0; i <= SRGB_ENCODE_STEPS; ++i)
+      values[i] = linear_to_srgb(static_cast<float>(i) / SRGB_ENCODE_STEPS) * 255.0f;
+    values[SRGB_ENCODE_STEPS + 1] = values[SRGB_ENCODE_STEPS];
+    return values;
+  }();
+  return table;
+}
 
-  boost::program_options::variables_map vm;
-  boost::program_options::store(
-      boost::program_options::parse_command_line(argc, argv, desc), vm);
-  boost::program_options::notify(vm);
+// stb_image layouts with an alpha channel: gray + alpha and RGBA.
+bool has_alpha(int channels) {
+  return channels == 2 || channels == 4;
+}
 
-  int strength = DEFAULT_STRENGTH;
-  float sigma_space = DEFAULT_SIGMA_SPACE;
-  float sigma_range = DEFAULT_SIGMA_RANGE;
-  std::string algorithm = DEFAULT_ALGORITHM;
-  std::string motion_direction;
+template <typename T>
+bool alpha_opaque(const T *data, size_t pixels, int channels) {
+  for (size_t i = 0; i < pixels; ++i)
+    if (data[i * channels + channels - 1] < (std::is_floating_point_v<T> ? 1 : sample_max<T>()))
+      return false;
+  return true;
+}
 
-  int width, height, channels;
-  unsigned char *image_data;
-  std::string image_name;
-  std::string output_name;
+// How image samples are read into floats on the 0-255 scale: scale maps the
+// range of T onto it, linear decodes sRGB to linear light, premultiply
+// multiplies colors by alpha, and drop_alpha leaves out an alpha channel
+// that is known to be opaque.
+struct input_decoding {
+  float scale = 1.0f;
+  bool linear = false;
+  bool premultiply = false;
+  bool drop_alpha = false;
+};
 
-  if (vm.count("help")) {
-    std::cout << desc << "\n";
-    return 0;
-  }
+// How float samples on the 0-255 scale become output samples: scale maps them
+// to the range of the output type (257 for 16-bit, 1/255 for HDR floats),
+// linear re-encodes linear light as sRGB, premultiplied divides colors by
+// alpha again, opaque_alpha appends the opaque alpha channel that
+// drop_alpha left out, and dither is an optional square pattern of offsets
+// added before rounding.
+struct output_encoding {
+  float scale = 1.0f;
+  bool linear = false;
+  bool premultiplied = false;
+  bool opaque_alpha = false;
+  std::vector<float> dither;
+};
 
-  if (vm.count("input")) {
-    image_name = vm["input"].as<std::string>();
-    image_data = stbi_load(image_name.c_str(), &width, &height, &channels, 0);
-  } else {
-    std::cerr << "Error: please specify input image" << std::endl;
-    return 1;
-  }
+int encoded_channels(int channels, const output_encoding &encoding) {
+  return channels + (encoding.opaque_alpha ? 1 : 0);
+}
 
-  if (image_data == nullptr) {
-    std::cerr << "Error: could not load image: " << image_name << std::endl;
-    return 1;
-  }
+// Converts a row of interleaved float samples into T, rounding to nearest and
+// saturating for integer types. channels counts the input samples per pixel;
+// the output has encoded_channels() of them. Alpha is never re-encoded.
+template <typename T>
+void quantize_row(const float *src, T *dst, int width, int channels, int y,
+                  const output_encoding &encoding) {
+  float scale = encoding.scale;
 
-  if (vm.count("output")) {
-    output_name = vm["output"].as<std::string>();
-  } else {
-    std::cerr << "Error: please specify output path: " << image_name
-              << std::endl;
-    return 1;
+  if (!encoding.linear && !encoding.premultiplied && !encoding.opaque_alpha &&
+      encoding.dither.empty()) {
+    int n = width * channels;
+    if constexpr (std::is_floating_point_v<T>) {
+      for (int x = 0; x < n; ++x)
+        dst[x] = src[x] * scale;
+    } else {
+      for (int x = 0; x < n; ++x)
+        dst[x] = static_cast<T>(std::clamp(src[x] * scale, 0.0f, sample_max<T>()) + 0.5f);
+    }
+    return;
   }
 
-  if (vm.count("strength"))
-    strength = vm["strength"].as<int>();
+  const std::vector<float> &pattern = encoding.dither;
+  const float *table = nullptr;
+  if (encoding.linear && !std::is_floating_point_v<T>)
+    table = srgb_encode_table().data();
 
-  if (vm.count("sigma_range"))
-    sigma_range = vm["sigma_range"].as<float>();
+  int out_channels = encoded_channels(channels, encoding);
+  int color_channels = has_alpha(out_channels) ? out_channels - 1 : out_channels;
+  int size = pattern.empty() ? 0 : std::sqrt(pattern.size());
+  const float *thresholds = size ? pattern.data() + (y % size) * size : nullptr;
 
-  if (vm.count("sigma_space"))
-    sigma_space = vm["sigma_space"].as<float>();
+  for (int j = 0; j < width; ++j) {
+    const float *pixel = src + j * channels;
+    float offset = thresholds ? thresholds[j % size] : 0.0f;
+    float inverse_alpha = 1.0f;
+    if (encoding.premultiplied) {
+      float alpha = pixel[channels - 1];
+      inverse_alpha = alpha > 0 ? 255.0f / alpha : 0.0f;
+    }
 
-  if (vm.count("algo"))
-    algorithm = vm["algo"].as<std::string>();
+    for (int c = 0; c < out_channels; ++c) {
+      float value = c < channels ? pixel[c] : 255.0f;
+      if (c < color_channels) {
+        value *= inverse_alpha;
+        if (table) {
+          float position = std::clamp(value, 0.0f, 255.0f) * (SRGB_ENCODE_STEPS / 255.0f);
+          int index = static_cast<int>(position);
+          value = table[index] + (position - index) * (table[index + 1] - table[index]);
+        }
+      }
 
-  if (algorithm == "motion") {
-    if (vm.count("direction")) {
-      motion_direction = vm["direction"].as<std::string>();
+      if constexpr (std::is_floating_point_v<T>)
+        dst[j * out_channels + c] = value * scale;
+      else
+        dst[j * out_channels + c] =
+            static_cast<T>(std::clamp(value * scale + offset, 0.0f, sample_max<T>()) + 0.5f);
+    }
+  }
+}
 
-      if (motion_direction != "vertical" && motion_direction != "horizontal" && motion_direction != "diagonal") {
-        std::cerr << "Error: Invalid motion direction (valid: horizontal, vertical, diagonal)." << std::endl;
-        return 1;
+// Applies the kernel vertical * horizontal^T as a horizontal pass followed by a
+// vertical pass. Borders are clamped exactly as pad_image() does, so the
+// result matches conv() with the equivalent dense kernel. The buffer between
+// the passes is held in Storage; sums are always accumulated in float. Each
+// finished output row is handed to emit(row_index, samples).
+template <typename Storage, typename Emit>
+void separable_pass(const std::vector<std::vector<std::vector<float>>> &image,
+                    const std::vector<float> &vertical,
+                    const std::vector<float> &horizontal, Emit &&emit) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int Hk = vertical.size();
+  int Wk = horizontal.size();
+  int pad_h = Hk / 2;
+  int pad_w = Wk / 2;
+  int row_size = Wi * channels;
+
+  std::vector<Storage> rows(static_cast<size_t>(Hi) * row_size);
+  std::vector<float> padded((Wi + Wk - 1) * channels);
+  std::vector<float> acc(row_size);
+
+  for (int image_h = 0; image_h < Hi; ++image_h) {
+    for (int j = 0; j < Wi + Wk - 1; ++j) {
+      int src_j = std::clamp(j - pad_w, 0, Wi - 1);
+      std::copy(image[image_h][src_j].begin(), image[image_h][src_j].end(),
+                padded.begin() + j * channels);
+    }
+
+    std::fill(acc.begin(), acc.end(), 0);
+    for (int kw = 0; kw < Wk; ++kw) {
+      const float *src = padded.data() + kw * channels;
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += horizontal[kw] * src[x];
+    }
+    store_row(acc.data(), rows.data() + static_cast<size_t>(image_h) * row_size, row_size);
+  }
+
+  std::vector<float> src(row_size);
+
+  for (int image_h = 0; image_h < Hi; ++image_h) {
+    std::fill(acc.begin(), acc.end(), 0);
+    for (int kh = 0; kh < Hk; ++kh) {
+      int src_i = std::clamp(image_h + kh - pad_h, 0, Hi - 1);
+      load_row(rows.data() + static_cast<size_t>(src_i) * row_size, src.data(), row_size);
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += vertical[kh] * src[x];
+    }
+    emit(image_h, acc.data());
+  }
+}
+
+template <typename Emit>
+void separable_pass(const std::vector<std::vector<std::vector<float>>> &image,
+                    const std::vector<float> &vertical,
+                    const std::vector<float> &horizontal,
+                    storage_format intermediate, Emit &&emit) {
+  if (intermediate == storage_format::fp16)
+    separable_pass<float16>(image, vertical, horizontal, emit);
+  else if (intermediate == storage_format::bf16)
+    separable_pass<bfloat16>(image, vertical, horizontal, emit);
+  else
+    separable_pass<float>(image, vertical, horizontal, emit);
+}
+
+std::vector<std::vector<std::vector<float>>>
+separable_conv(const std::vector<std::vector<std::vector<float>>> &image,
+               const std::vector<float> &vertical,
+               const std::vector<float> &horizontal,
+               storage_format intermediate = storage_format::fp32) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+  separable_pass(image, vertical, horizontal, intermediate, [&](int image_h, const float *row) {
+    for (int image_w = 0; image_w < Wi; ++image_w)
+      std::copy(row + image_w * channels, row + (image_w + 1) * channels,
+                out[image_h][image_w].begin());
+  });
+
+  return out;
+}
+
+// separable_conv() with the quantization to the output sample type fused
+// into the vertical pass, so no float output image is allocated.
+template <typename T>
+std::vector<T>
+separable_conv_quantized(const std::vector<std::vector<std::vector<float>>> &image,
+                         const std::vector<float> &vertical,
+                         const std::vector<float> &horizontal,
+                         storage_format intermediate,
+                         const output_encoding &encoding) {
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  size_t row_size = static_cast<size_t>(Wi) * encoded_channels(channels, encoding);
+
+  std::vector<T> out(image.size() * row_size);
+
+  separable_pass(image, vertical, horizontal, intermediate, [&](int image_h, const float *row) {
+    quantize_row(row, out.data() + image_h * row_size, Wi, channels, image_h, encoding);
+  });
+
+  return out;
+}
+
+// Taps that produce one sample of a resampled row or column from the
+// source samples first, first + 1, ...
+struct resample_taps {
+  int first = 0;
+  std::vector<float> weights;
+};
+
+// Combines the blur kernel with a tent resampling filter that takes in samples
+// to out, so that each output sample is read straight from the source. When
+// shrinking the tent widens to in / out samples to anti-alias. Borders clamp
+// as in separable_pass(), so the taps reproduce blurring and then resampling
+// the blurred image.
+std::vector<resample_taps> resample_weights(int in, int out, const std::vector<float> &blur) {
+  float scale = static_cast<float>(in) / out;
+  float radius = std::max(1.0f, scale);
+  int pad = blur.size() / 2;
+  std::vector<resample_taps> taps(out);
+
+  for (int o = 0; o < out; ++o) {
+    float center = (o + 0.5f) * scale - 0.5f;
+    int t0 = static_cast<int>(std::ceil(center - radius));
+    int t1 = static_cast<int>(std::floor(center + radius));
+
+    int first = std::clamp(std::clamp(t0, 0, in - 1) - pad, 0, in - 1);
+    int last = std::clamp(std::clamp(t1, 0, in - 1) + static_cast<int>(blur.size()) - 1 - pad, 0, in - 1);
+
+    std::vector<float> &weights = taps[o].weights;
+    weights.assign(last - first + 1, 0);
+    taps[o].first = first;
+    float total = 0;
+    for (int t = t0; t <= t1; ++t) {
+      float tent = 1 - std::abs(t - center) / radius;
+      if (tent <= 0)
+        continue;
+      total += tent;
+      int blurred = std::clamp(t, 0, in - 1);
+      for (size_t k = 0; k < blur.size(); ++k) {
+        int source = std::clamp(blurred + static_cast<int>(k) - pad, 0, in - 1);
+        weights[source - first] += tent * blur[k];
       }
-    } else {
-      std::cerr << "Error: Please specify motion direction (horizontal, vertical, diagonal)." << std::endl;
-      return 1;
     }
+
+    for (float &weight : weights)
+      weight /= total;
+  }
+
+  return taps;
+}
+
+// Blurs with the kernel vertical * horizontal^T and resamples to
+// height x width in the same two passes, so the blurred image is never held
+// at full resolution; only the rows resampled horizontally are. Kernels of
+// {1} resample without blurring.
+std::vector<std::vector<std::vector<float>>>
+separable_resample(const std::vector<std::vector<std::vector<float>>> &image,
+                   const std::vector<float> &vertical,
+                   const std::vector<float> &horizontal, int height, int width) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int row_size = width * channels;
+  auto columns = resample_weights(Wi, width, horizontal);
+  auto rows = resample_weights(Hi, height, vertical);
+
+  std::vector<float> resampled(static_cast<size_t>(Hi) * row_size, 0);
+  for (int i = 0; i < Hi; ++i) {
+    float *dst = resampled.data() + static_cast<size_t>(i) * row_size;
+    for (int j = 0; j < width; ++j) {
+      const resample_taps &tap = columns[j];
+      for (size_t k = 0; k < tap.weights.size(); ++k) {
+        const std::vector<float> &src = image[i][tap.first + k];
+        for (int c = 0; c < channels; ++c)
+          dst[j * channels + c] += tap.weights[k] * src[c];
+      }
+    }
+  }
+
+  std::vector<std::vector<std::vector<float>>> out(
+      height, std::vector<std::vector<float>>(width, std::vector<float>(channels, 0)));
+  std::vector<float> acc(row_size);
+
+  for (int i = 0; i < height; ++i) {
+    const resample_taps &tap = rows[i];
+    std::fill(acc.begin(), acc.end(), 0);
+    for (size_t k = 0; k < tap.weights.size(); ++k) {
+      const float *src = resampled.data() + static_cast<size_t>(tap.first + k) * row_size;
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += tap.weights[k] * src[x];
+    }
+    for (int j = 0; j < width; ++j)
+      std::copy(acc.begin() + j * channels, acc.begin() + (j + 1) * channels, out[i][j].begin());
+  }
+
+  return out;
+}
+
+std::vector<std::vector<std::vector<float>>>
+bilateral_conv(const std::vector<std::vector<std::vector<float>>> &image,
+               const std::vector<std::vector<std::vector<float>>> &kernel, float sigma_range) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int Hk = kernel.size();
+  int Wk = kernel[0].size();
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+  int pad_h = Hk / 2;
+  int pad_w = Wk / 2;
+  std::vector<std::vector<std::vector<float>>> padded =
+      pad_image(image, pad_h, pad_w);
+
+  for (int image_h = 0; image_h < Hi; ++image_h) {
+    for (int image_w = 0; image_w < Wi; ++image_w) {
+      for (int c = 0; c < channels; ++c) {
+        float sum = 0;
+        float weight_sum = 0;
+
+        for (int kh = 0; kh < Hk; ++kh) {
+          for (int kw = 0; kw < Wk; ++kw) {
+            float intensity_diff = image[image_h][image_w][c] - padded[image_h + kh][image_w + kw][c];
+            float range_gaussian = std::exp(-(intensity_diff * intensity_diff) / (2 * sigma_range * sigma_range));
+
+            float weight = kernel[kh][kw][c] * range_gaussian;
+            sum += padded[image_h + kh][image_w + kw][c] * weight;
+            weight_sum += weight;
+          }
+        }
+        out[image_h][image_w][c] = sum / weight_sum;
+      }
+    }
+  }
+
+  return out;
+}
+
+// 1D weights of the box and gaussian kernels. Both kernels are separable, so
+// the 2D kernel is the outer product of these with themselves.
+std::vector<float> box_weights(int size) {
+  return std::vector<float>(size, 1.0f / size);
+}
+
+std::vector<float> gaussian_weights(int size) {
+  std::vector<float> weights(size);
+  double sigma = ((double)size / 2 > 1) ? (double)size / 2 : 1;
+  int k = (size - 1) / 2;
+  double sum = 0.0;
+
+  for (int i = 0; i < size; ++i) {
+    weights[i] = std::exp(-std::pow(i - k, 2) / (2 * sigma * sigma));
+    sum += weights[i];
+  }
+  for (float &weight : weights)
+    weight /= sum;
+
+  return weights;
+}
+
+std::vector<std::vector<std::vector<float>>> bilateral_kernel(
+  const std::vector<std::vector<std::vector<float>>> &image, int size, float sigma_space, float sigma_range, int channels) {
+
+  std::vector<std::vector<std::vector<float>>> kernel(
+      size,
+      std::vector<std::vector<float>>(size, std::vector<float>(channels, 0)));
+
+  int k = (size - 1) / 2;
+
+  for (int i = 0; i < size; ++i) {
+    for (int j = 0; j < size; ++j) {
+      float spatial_gaussian = std::exp(-((i - k) * (i - k) + (j - k) * (j - k)) / (2 * sigma_space * sigma_space));
+      for (int c = 0; c < channels; ++c) {
+        kernel[i][j][c] = spatial_gaussian;
+      }
+    }
+  }
+
+  return kernel;
+}
+
+std::vector<std::vector<std::vector<float>>>
+median_filter(const std::vector<std::vector<std::vector<float>>> &image, int kernel_size) {
+    int Hi = image.size();
+    int Wi = image[0].size();
+    int channels = image[0][0].size();
+    int pad_h = kernel_size / 2;
+    int pad_w = kernel_size / 2;
+    std::vector<std::vector<std::vector<float>>> out(
+        Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+    std::vector<std::vector<std::vector<float>>> padded = pad_image(image, pad_h, pad_w);
+
+    for (int image_h = 0; image_h < Hi; ++image_h) {
+        for (int image_w = 0; image_w < Wi; ++image_w) {
+            for (int c = 0; c < channels; ++c) {
+                std::vector<float> neighborhood;
+                for (int kh = 0; kh < kernel_size; ++kh) {
+                    for (int kw = 0; kw < kernel_size; ++kw) {
+                        neighborhood.push_back(padded[image_h + kh][image_w + kw][c]);
+                    }
+                }
+                std::sort(neighborhood.begin(), neighborhood.end());
+                out[image_h][image_w][c] = neighborhood[neighborhood.size() / 2];
+            }
+        }
+    }
+
+    return out;
+}
+
+// Samples are kept on a 0-255 scale whatever the file depth; see
+// output_encoding for how they are written back.
+template <typename T>
+std::vector<T>
+flatten_image(const std::vector<std::vector<std::vector<float>>> &image,
+              int width, int height, const output_encoding &encoding = {}) {
+  int channels = image[0][0].size();
+  size_t row_size = static_cast<size_t>(width) * encoded_channels(channels, encoding);
+  std::vector<T> flat_image(row_size * height);
+  std::vector<float> row(width * channels);
+
+  for (int i = 0; i < height; ++i) {
+    for (int j = 0; j < width; ++j)
+      std::copy(image[i][j].begin(), image[i][j].end(), row.begin() + j * channels);
+    quantize_row(row.data(), flat_image.data() + i * row_size, width, channels, i, encoding);
   }
 
+  return flat_image;
+}
+
+// Reads interleaved samples into the float image in one pass, applying the
+// conversions selected in decoding. Float (HDR) samples are already linear.
+template <typename T>
+std::vector<std::vector<std::vector<float>>>
+unflatten_image(const T *data, int width, int height, int channels,
+                const input_decoding &decoding = {}) {
+  int image_channels = decoding.drop_alpha ? channels - 1 : channels;
+  int color_channels = has_alpha(channels) ? channels - 1 : channels;
+  float scale = decoding.scale;
+
   std::vector<std::vector<std::vector<float>>> image(
       height,
-      std::vector<std::vector<float>>(width, std::vector<float>(channels)));
+      std::vector<std::vector<float>>(width, std::vector<float>(image_channels)));
 
   for (int i = 0; i < height; ++i) {
     for (int j = 0; j < width; ++j) {
-      for (int c = 0; c < channels; ++c) {
-        image[i][j][c] =
-            static_cast<float>(image_data[(i * width + j) * channels + c]);
+      const T *pixel = data + (static_cast<size_t>(i) * width + j) * channels;
+      float alpha = decoding.premultiply ? pixel[channels - 1] * scale / 255.0f : 1.0f;
+
+      for (int c = 0; c < image_channels; ++c) {
+        float value = static_cast<float>(pixel[c]) * scale;
+        if constexpr (!std::is_floating_point_v<T>) {
+          if (decoding.linear && c < color_channels)
+            value = srgb_decode_table<T>()[pixel[c]];
+        }
+        image[i][j][c] = c < color_channels ? value * alpha : value;
       }
     }
   }
 
-  std::vector<std::vector<std::vector<float>>> blurred_image;
+  return image;
+}
 
-  if (algorithm == "gaussian")
-    blurred_image = conv(image, gaussian_kernel(strength, channels));
-  else if (algorithm == "box")
-    blurred_image = conv(image, box_kernel(strength, channels));
-  else if (algorithm == "bilateral")
-    blurred_image = bilateral_conv(image, bilateral_kernel(image, strength, sigma_space, sigma_range, channels), sigma_range);
-  else if (algorithm == "median")
-    blurred_image = median_filter(image, strength);
-  else if (algorithm == "motion")
-        blurred_image = conv(image, motion_kernel(strength, motion_direction, channels));
+// unflatten_image() at 1/factor of the resolution: each output pixel is the
+// mean of a factor x factor block, averaged after decoding. Only factor rows
+// are converted to float at a time.
+template <typename T>
+std::vector<std::vector<std::vector<float>>>
+unflatten_reduced(const T *data, int width, int height, int channels, int factor,
+                  const input_decoding &decoding = {}) {
+  int reduced_height = (height + factor - 1) / factor;
+  int reduced_width = (width + factor - 1) / factor;
+  int image_channels = decoding.drop_alpha ? channels - 1 : channels;
 
-  auto output_image = flatten_image(blurred_image, width, height, channels);
-  std::string extension = output_name.substr(output_name.find_last_of('.') + 1);
+  std::vector<std::vector<std::vector<float>>> image(
+      reduced_height,
+      std::vector<std::vector<float>>(reduced_width, std::vector<float>(image_channels, 0)));
 
-  if (extension == "png") {
-    stbi_write_png(output_name.c_str(), width, height, channels,
-                   output_image.data(), width * channels);
-  } else if (extension == "jpg" || extension == "jpeg") {
-    stbi_write_jpg(output_name.c_str(), width, height, channels,
-                   output_image.data(), 100);
-  } else {
-    std::cerr << "Error: Unsupported output file format. Please use .png or "
-                 ".jpg/.jpeg"
-              << std::endl;
-    return 1;
+  for (int i = 0; i < reduced_height; ++i) {
+    int rows = std::min(factor, height - i * factor);
+    auto band = unflatten_image(data + static_cast<size_t>(i) * factor * width * channels,
+                                width, rows, channels, decoding);
+
+    for (int j = 0; j < reduced_width; ++j) {
+      int cols = std::min(factor, width - j * factor);
+      for (int y = 0; y < rows; ++y)
+        for (int x = 0; x < cols; ++x)
+          for (int c = 0; c < image_channels; ++c)
+            image[i][j][c] += band[y][j * factor + x][c];
+      for (float &value : image[i][j])
+        value /= rows * cols;
+    }
   }
 
-  stbi_image_free(image_data);
+  return image;
+}
 
-  return 0;
+std::vector<std::vector<std::vector<float>>> motion_kernel(int size, const std::string &direction, int channels) {
+    std::vector<std::vector<std::vector<float>>> kernel(size,
+        std::vector<std::vector<float>>(size, std::vector<float>(channels, 0)));
+
+    float value = 1.0f / size;
+
+    if (direction == "vertical") {
+        for (int i = 0; i < size; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                kernel[i][0][c] = value;
+            }
+        }
+    } else if (direction == "horizontal") {
+        for (int j = 0; j < size; ++j) {
+            for (int c = 0; c < channels; ++c) {
+                kernel[0][j][c] = value;
+            }
+        }
+    } else if (direction == "diagonal") {
+        for (int i = 0; i < size; ++i) {
+            for (int j = 0; j < size; ++j) {
+                for (int c = 0; c < channels; ++c) {
+                    if (i == j) {
+                        kernel[i][j][c] = value;
+                    }
+                }
+            }
+        }
+    }
+
+    return kernel;
+}
+
+// Quantizes non-negative weights to FIXED_SHIFT fractional bits. Rounding
+// error is folded into the largest weight so the weights still sum to one.
+std::vector<int32_t> fixed_weights(const std::vector<float> &weights) {
+  std::vector<int32_t> fixed(weights.size());
+  int32_t total = 0;
+  size_t largest = 0;
+
+  for (size_t i = 0; i < weights.size(); ++i) {
+    fixed[i] = std::lround(weights[i] * (1 << FIXED_SHIFT));
+    total += fixed[i];
+    if (weights[i] > weights[largest])
+      largest = i;
+  }
+  fixed[largest] += (1 << FIXED_SHIFT) - total;
+
+  return fixed;
+}
+
+// Copies row y of an interleaved image into dst with pad pixels of
+// clamped border on each side.
+template <typename T>
+void pad_row(const T *data, int width, int channels, int y, int pad, std::vector<T> &dst) {
+  const T *row = data + static_cast<size_t>(y) * width * channels;
+  dst.resize((width + 2 * pad) * channels);
+  for (int j = 0; j < width + 2 * pad; ++j) {
+    int src_j = std::clamp(j - pad, 0, width - 1);
+    std::copy(row + src_j * channels, row + (src_j + 1) * channels, dst.begin() + j * channels);
+  }
+}
+
+// Integer types used by the fixed-point kernels for each sample type. The
+// intermediate buffer between separable passes keeps 8 extra fractional bits
+// and the accumulator must hold a full sum of weighted intermediates.
+template <typename T> struct fixed_traits;
+
+template <> struct fixed_traits<unsigned char> {
+  using intermediate = uint16_t;
+  using accumulator = uint32_t;
+  static constexpr uint32_t max = 255;
+};
+
+template <> struct fixed_traits<uint16_t> {
+  using intermediate = uint32_t;
+  using accumulator = uint64_t;
+  static constexpr uint32_t max = 65535;
+};
+
+// Separable blur on integer samples without converting to float. The
+// horizontal pass keeps 8 fractional bits in the intermediate buffer and the
+// vertical pass rounds to nearest and saturates on the way back.
+template <typename T>
+std::vector<T>
+fixed_separable_conv(const T *data, int width, int height, int channels,
+                     const std::vector<float> &vertical,
+                     const std::vector<float> &horizontal) {
+  std::vector<int32_t> v_weights = fixed_weights(vertical);
+  std::vector<int32_t> h_weights = fixed_weights(horizontal);
+  int Hk = vertical.size();
+  int Wk = horizontal.size();
+  int pad_h = Hk / 2;
+  int pad_w = Wk / 2;
+  int row_size = width * channels;
+
+  using intermediate = typename fixed_traits<T>::intermediate;
+  using accumulator = typename fixed_traits<T>::accumulator;
+
+  std::vector<intermediate> rows(static_cast<size_t>(height) * row_size);
+  std::vector<T> padded;
+  std::vector<accumulator> acc(row_size);
+
+  for (int i = 0; i < height; ++i) {
+    pad_row(data, width, channels, i, pad_w, padded);
+    std::fill(acc.begin(), acc.end(), 0);
+    for (int kw = 0; kw < Wk; ++kw) {
+      accumulator weight = h_weights[kw];
+      if (weight == 0)
+        continue;
+      const T *src = padded.data() + kw * channels;
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += weight * src[x];
+    }
+
+    intermediate *dst = rows.data() + static_cast<size_t>(i) * row_size;
+    for (int x = 0; x < row_size; ++x)
+      dst[x] = (acc[x] + (1 << (FIXED_SHIFT - 9))) >> (FIXED_SHIFT - 8);
+  }
+
+  std::vector<T> out(static_cast<size_t>(height) * row_size);
+
+  for (int i = 0; i < height; ++i) {
+    std::fill(acc.begin(), acc.end(), 0);
+    for (int kh = 0; kh < Hk; ++kh) {
+      accumulator weight = v_weights[kh];
+      if (weight == 0)
+        continue;
+      int src_i = std::clamp(i + kh - pad_h, 0, height - 1);
+      const intermediate *src = rows.data() + static_cast<size_t>(src_i) * row_size;
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += weight * src[x];
+    }
+
+    T *dst = out.data() + static_cast<size_t>(i) * row_size;
+    for (int x = 0; x < row_size; ++x)
+      dst[x] = std::min<accumulator>((acc[x] + (1 << (FIXED_SHIFT + 7))) >> (FIXED_SHIFT + 8),
+                                     fixed_traits<T>::max);
+  }
+
+  return out;
+}
+
+// Single pass over the non-zero taps of a sparse kernel, such as the line
+// kernels built by motion_kernel(), in fixed point.
+template <typename T>
+std::vector<T>
+fixed_sparse_conv(const T *data, int width, int height, int channels,
+                  const std::vector<std::vector<std::vector<float>>> &kernel) {
+  int Hk = kernel.size();
+  int Wk = kernel[0].size();
+  int pad_h = Hk / 2;
+  int pad_w = Wk / 2;
+  int row_size = width * channels;
+
+  std::vector<std::pair<int, int>> taps;
+  std::vector<float> weights;
+  for (int kh = 0; kh < Hk; ++kh) {
+    for (int kw = 0; kw < Wk; ++kw) {
+      if (kernel[kh][kw][0] != 0) {
+        taps.push_back({kh, kw});
+        weights.push_back(kernel[kh][kw][0]);
+      }
+    }
+  }
+  std::vector<int32_t> fixed = fixed_weights(weights);
+
+  using accumulator = typename fixed_traits<T>::accumulator;
+
+  std::vector<std::vector<T>> padded(height);
+  for (int i = 0; i < height; ++i)
+    pad_row(data, width, channels, i, pad_w, padded[i]);
+
+  std::vector<T> out(static_cast<size_t>(height) * row_size);
+  std::vector<accumulator> acc(row_size);
+
+  for (int i = 0; i < height; ++i) {
+    std::fill(acc.begin(), acc.end(), 0);
+    for (size_t t = 0; t < taps.size(); ++t) {
+      accumulator weight = fixed[t];
+      int src_i = std::clamp(i + taps[t].first - pad_h, 0, height - 1);
+      const T *src = padded[src_i].data() + taps[t].second * channels;
+      for (int x = 0; x < row_size; ++x)
+        acc[x] += weight * src[x];
+    }
+
+    T *dst = out.data() + static_cast<size_t>(i) * row_size;
+    for (int x = 0; x < row_size; ++x)
+      dst[x] = std::min<accumulator>((acc[x] + (1 << (FIXED_SHIFT - 1))) >> FIXED_SHIFT,
+                                     fixed_traits<T>::max);
+  }
+
+  return out;
+}
+
+// Horizontal extent [first, last] of the aperture on each kernel row. A blade
+// count of 0 gives a circular disc, otherwise a regular polygon with one
+// vertex pointing up.
+std::vector<std::pair<int, int>> lens_spans(int size, int blades) {
+  int k = (size - 1) / 2;
+  float radius = k + 0.5f;
+  std::vector<std::pair<int, int>> spans(2 * k + 1, {1, 0});
+
+  for (int dy = -k; dy <= k; ++dy) {
+    for (int dx = -k; dx <= k; ++dx) {
+      float dist = std::sqrt(dx * dx + dy * dy);
+      float limit = radius;
+
+      if (blades >= 3) {
+        float sector = 2 * M_PI / blades;
+        float theta = std::atan2(dx, -dy);
+        float offset = std::fmod(theta + 2 * M_PI, sector) - sector / 2;
+        limit = radius * std::cos(sector / 2) / std::cos(offset);
+      }
+
+      if (dist <= limit) {
+        auto &span = spans[dy + k];
+        if (span.first > span.second)
+          span = {dx, dx};
+        span.first = std::min(span.first, dx);
+        span.second = std::max(span.second, dx);
+      }
+    }
+  }
+
+  return spans;
+}
+
+// Uniform aperture blur. The aperture is convex, so each kernel row covers a
+// single span that is summed from per-row prefix sums, making the cost per
+// pixel proportional to the kernel height instead of its area.
+std::vector<std::vector<std::vector<float>>>
+lens_blur(const std::vector<std::vector<std::vector<float>>> &image,
+          const std::vector<std::pair<int, int>> &spans) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int k = spans.size() / 2;
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+  int area = 0;
+  for (const auto &span : spans)
+    area += std::max(0, span.second - span.first + 1);
+
+  std::vector<std::vector<std::vector<float>>> padded = pad_image(image, k, k);
+  int padded_Wi = Wi + 2 * k;
+
+  std::vector<std::vector<double>> prefix(
+      Hi + 2 * k, std::vector<double>((padded_Wi + 1) * channels, 0));
+  for (int i = 0; i < Hi + 2 * k; ++i) {
+    for (int j = 0; j < padded_Wi; ++j) {
+      for (int c = 0; c < channels; ++c) {
+        prefix[i][(j + 1) * channels + c] =
+            prefix[i][j * channels + c] + padded[i][j][c];
+      }
+    }
+  }
+
+  for (int image_h = 0; image_h < Hi; ++image_h) {
+    for (int image_w = 0; image_w < Wi; ++image_w) {
+      for (int c = 0; c < channels; ++c) {
+        double sum = 0;
+        for (int dy = 0; dy < 2 * k + 1; ++dy) {
+          const auto &span = spans[dy];
+          if (span.first > span.second)
+            continue;
+          const auto &row = prefix[image_h + dy];
+          sum += row[(image_w + k + span.second + 1) * channels + c] -
+                 row[(image_w + k + span.first) * channels + c];
+        }
+        out[image_h][image_w][c] = sum / area;
+      }
+    }
+  }
+
+  return out;
+}
+
+// Reads a convolution kernel from either a text file (one row per line,
+// whitespace separated, '#' starts a comment) or a binary file made of the
+// KERNEL_MAGIC tag, int32 height and width, and row-major float32 values.
+// The kernel is normalized to unit sum unless its sum is zero.
+bool load_kernel(const std::string &path, std::vector<std::vector<float>> &kernel) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+
+  kernel.clear();
+
+  char magic[4] = {};
+  file.read(magic, sizeof(magic));
+  if (file.gcount() == 4 && std::memcmp(magic, KERNEL_MAGIC, 4) == 0) {
+    int32_t rows, cols;
+    file.read(reinterpret_cast<char *>(&rows), sizeof(rows));
+    file.read(reinterpret_cast<char *>(&cols), sizeof(cols));
+    if (!file || rows <= 0 || cols <= 0)
+      return false;
+
+    kernel.assign(rows, std::vector<float>(cols));
+    for (auto &row : kernel)
+      file.read(reinterpret_cast<char *>(row.data()), cols * sizeof(float));
+    if (!file)
+      return false;
+  } else {
+    file.clear();
+    file.seekg(0);
+
+    std::string line;
+    while (std::getline(file, line)) {
+      line = line.substr(0, line.find('#'));
+      std::istringstream values(line);
+      std::vector<float> row;
+      float value;
+      while (values >> value)
+        row.push_back(value);
+      if (!values.eof())
+        return false;
+      if (row.empty())
+        continue;
+      if (!kernel.empty() && row.size() != kernel[0].size())
+        return false;
+      kernel.push_back(row);
+    }
+
+    if (kernel.empty())
+      return false;
+  }
+
+  double sum = 0;
+  for (const auto &row : kernel)
+    for (float value : row)
+      sum += value;
+
+  if (sum != 0) {
+    for (auto &row : kernel)
+      for (float &value : row)
+        value /= sum;
+  }
+
+  return true;
+}
+
+struct separable_term {
+  std::vector<float> vertical;
+  std::vector<float> horizontal;
+};
+
+// Decomposes the kernel with a one-sided Jacobi SVD and returns the fewest
+// rank-1 terms whose sum reproduces it to within KERNEL_RANK_TOLERANCE
+// (relative Frobenius norm).
+std::vector<separable_term> separable_terms(const std::vector<std::vector<float>> &kernel) {
+  int m = kernel.size();
+  int n = kernel[0].size();
+
+  std::vector<std::vector<double>> a(n, std::vector<double>(m));
+  std::vector<std::vector<double>> v(n, std::vector<double>(n, 0));
+  for (int j = 0; j < n; ++j) {
+    for (int i = 0; i < m; ++i)
+      a[j][i] = kernel[i][j];
+    v[j][j] = 1;
+  }
+
+  for (int sweep = 0; sweep < 60; ++sweep) {
+    bool rotated = false;
+    for (int p = 0; p < n - 1; ++p) {
+      for (int q = p + 1; q < n; ++q) {
+        double alpha = 0, beta = 0, gamma = 0;
+        for (int i = 0; i < m; ++i) {
+          alpha += a[p][i] * a[p][i];
+          beta += a[q][i] * a[q][i];
+          gamma += a[p][i] * a[q][i];
+        }
+        if (std::abs(gamma) <= 1e-15 * std::sqrt(alpha * beta) || gamma == 0)
+          continue;
+
+        rotated = true;
+        double zeta = (beta - alpha) / (2 * gamma);
+        double t = (zeta >= 0 ? 1 : -1) / (std::abs(zeta) + std::sqrt(1 + zeta * zeta));
+        double cs = 1 / std::sqrt(1 + t * t);
+        double sn = cs * t;
+        for (int i = 0; i < m; ++i) {
+          double ap = a[p][i], aq = a[q][i];
+          a[p][i] = cs * ap - sn * aq;
+          a[q][i] = sn * ap + cs * aq;
+        }
+        for (int i = 0; i < n; ++i) {
+          double vp = v[p][i], vq = v[q][i];
+          v[p][i] = cs * vp - sn * vq;
+          v[q][i] = sn * vp + cs * vq;
+        }
+      }
+    }
+    if (!rotated)
+      break;
+  }
+
+  std::vector<std::pair<double, int>> singular(n);
+  double total = 0;
+  for (int j = 0; j < n; ++j) {
+    double norm = 0;
+    for (int i = 0; i < m; ++i)
+      norm += a[j][i] * a[j][i];
+    singular[j] = {std::sqrt(norm), j};
+    total += norm;
+  }
+  std::sort(singular.rbegin(), singular.rend());
+
+  std::vector<separable_term> terms;
+  double residual = total;
+  for (const auto &[sigma, j] : singular) {
+    if (sigma == 0 || residual <= total * KERNEL_RANK_TOLERANCE * KERNEL_RANK_TOLERANCE)
+      break;
+
+    separable_term term;
+    term.vertical.resize(m);
+    term.horizontal.resize(n);
+    for (int i = 0; i < m; ++i)
+      term.vertical[i] = a[j][i];
+    for (int i = 0; i < n; ++i)
+      term.horizontal[i] = v[j][i];
+    terms.push_back(term);
+    residual -= sigma * sigma;
+  }
+
+  return terms;
+}
+
+// Runs a loaded kernel as a sum of its separable terms, as returned by
+// separable_terms(), when its rank makes that cheaper than the dense (or FFT)
+// path through conv(). Each pass also pays SEPARABLE_TERM_COST for its
+// intermediate image and the sum into out.
+std::vector<std::vector<std::vector<float>>>
+custom_conv(const std::vector<std::vector<std::vector<float>>> &image,
+            const std::vector<std::vector<float>> &kernel,
+            const std::vector<separable_term> &terms,
+            storage_format intermediate) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int Hk = kernel.size();
+  int Wk = kernel[0].size();
+
+  double separable_cost = terms.size() * (Hk + Wk + SEPARABLE_TERM_COST);
+  double dense_cost = std::min<double>(fft_cost(Hk, Wk, channels), Hk * Wk);
+
+  if (terms.empty() || separable_cost >= dense_cost) {
+    std::vector<std::vector<std::vector<float>>> dense(
+        Hk, std::vector<std::vector<float>>(Wk, std::vector<float>(channels)));
+    for (int kh = 0; kh < Hk; ++kh)
+      for (int kw = 0; kw < Wk; ++kw)
+        std::fill(dense[kh][kw].begin(), dense[kh][kw].end(), kernel[kh][kw]);
+    return conv(image, dense);
+  }
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+  for (const auto &term : terms) {
+    auto partial = separable_conv(image, term.vertical, term.horizontal, intermediate);
+    for (int image_h = 0; image_h < Hi; ++image_h)
+      for (int image_w = 0; image_w < Wi; ++image_w)
+        for (int c = 0; c < channels; ++c)
+          out[image_h][image_w][c] += partial[image_h][image_w][c];
+  }
+
+  return out;
+}
+
+// Box blur whose radius follows a grayscale map: black keeps the pixel sharp
+// and white blurs with the full radius (size - 1) / 2. Every box sum is read
+// from a summed-area table, so the cost per pixel does not depend on its
+// radius. Fractional radii blend the two nearest box sizes.
+std::vector<std::vector<std::vector<float>>>
+variable_blur(const std::vector<std::vector<std::vector<float>>> &image,
+              const std::vector<std::vector<float>> &radius_map, int size) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int k = (size - 1) / 2;
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(channels, 0)));
+
+  std::vector<std::vector<std::vector<float>>> padded = pad_image(image, k, k);
+  int padded_Hi = Hi + 2 * k;
+  int padded_Wi = Wi + 2 * k;
+
+  std::vector<std::vector<double>> table(
+      padded_Hi + 1, std::vector<double>((padded_Wi + 1) * channels, 0));
+  for (int i = 0; i < padded_Hi; ++i) {
+    for (int j = 0; j < padded_Wi; ++j) {
+      for (int c = 0; c < channels; ++c) {
+        table[i + 1][(j + 1) * channels + c] =
+            padded[i][j][c] + table[i][(j + 1) * channels + c] +
+            table[i + 1][j * channels + c] - table[i][j * channels + c];
+      }
+    }
+  }
+
+  auto box_mean = [&](int i, int j, int r, int c) {
+    int top = i + k - r, bottom = i + k + r + 1;
+    int left = j + k - r, right = j + k + r + 1;
+    double sum = table[bottom][right * channels + c] - table[top][right * channels + c] -
+                 table[bottom][left * channels + c] + table[top][left * channels + c];
+    return sum / ((2 * r + 1) * (2 * r + 1));
+  };
+
+  for (int image_h = 0; image_h < Hi; ++image_h) {
+    for (int image_w = 0; image_w < Wi; ++image_w) {
+      float radius = std::clamp(radius_map[image_h][image_w], 0.0f, 1.0f) * k;
+      int r0 = static_cast<int>(radius);
+      int r1 = std::min(r0 + 1, k);
+      float t = radius - r0;
+
+      for (int c = 0; c < channels; ++c) {
+        double lower = box_mean(image_h, image_w, r0, c);
+        double upper = t > 0 ? box_mean(image_h, image_w, r1, c) : lower;
+        out[image_h][image_w][c] = lower + (upper - lower) * t;
+      }
+    }
+  }
+
+  return out;
+}
+
+// Loads a grayscale map scaled to [0, 1], resampled with nearest neighbour
+// when its dimensions differ from the image.
+// A grayscale radius map or mask as it was decoded, before fit_map() scales
+// it to an image.
+struct gray_map {
+  int width = 0, height = 0;
+  std::vector<unsigned char> values;
+};
+
+bool load_map(const std::string &path, gray_map &map) {
+  int map_channels;
+  unsigned char *data = stbi_load(path.c_str(), &map.width, &map.height, &map_channels, 1);
+  if (data == nullptr)
+    return false;
+
+  map.values.assign(data, data + static_cast<size_t>(map.width) * map.height);
+  stbi_image_free(data);
+  return true;
+}
+
+// Scales map to width x height, nearest neighbour, with values from 0 to 1.
+void fit_map(const gray_map &source, int width, int height,
+             std::vector<std::vector<float>> &map) {
+  map.assign(height, std::vector<float>(width));
+  for (int i = 0; i < height; ++i) {
+    int src_i = static_cast<long>(i) * source.height / height;
+    for (int j = 0; j < width; ++j) {
+      int src_j = static_cast<long>(j) * source.width / width;
+      map[i][j] = source.values[static_cast<size_t>(src_i) * source.width + src_j] / 255.0f;
+    }
+  }
+}
+
+// Threads kept for the life of the process and shared by every image, so
+// that encoding each image of a batch or request does not start and join
+// threads of its own. A task is handed to an idle worker, or to a new one
+// while the pool is below its limit (--threads, or one per core), and
+// otherwise waits its turn. A task started with run() may block for as long
+// as a pipeline stage, so it raises the limit by one until it returns and
+// cannot leave the other tasks without a worker.
+struct worker_pool {
+  std::mutex lock;
+  std::condition_variable ready;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> workers;
+  size_t idle = 0;
+  size_t limit = std::max(1u, std::thread::hardware_concurrency());
+  size_t running = 0;
+  bool stopping = false;
+
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  void set_limit(size_t threads) {
+    std::lock_guard<std::mutex> guard(lock);
+    limit = threads;
+  }
+
+  void post(std::function<void()> task) {
+    std::lock_guard<std::mutex> guard(lock);
+    push(std::move(task));
+  }
+
+  // Runs task on a worker; the future is ready once it has returned.
+  std::future<void> run(std::function<void()> task) {
+    auto job = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> done = job->get_future();
+    std::lock_guard<std::mutex> guard(lock);
+    ++running;
+    push([this, job] {
+      (*job)();
+      std::lock_guard<std::mutex> guard(lock);
+      --running;
+    });
+    return done;
+  }
+
+private:
+  void push(std::function<void()> task) {
+    tasks.push_back(std::move(task));
+    if (idle < tasks.size() && workers.size() < limit + running)
+      workers.emplace_back([this] { work(); });
+    else
+      ready.notify_one();
+  }
+
+  void work() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+      ++idle;
+      ready.wait(guard, [&] { return stopping || !tasks.empty(); });
+      --idle;
+      if (tasks.empty())
+        return;
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      guard.unlock();
+      task();
+      guard.lock();
+    }
+  }
+};
+
+worker_pool &shared_workers() {
+  static worker_pool pool;
+  return pool;
+}
+
+// Runs task(i) for every i in [0, count) on the calling thread and up to
+// threads - 1 pool workers, each taking the next index as it finishes one.
+// The caller only waits for workers that have started, so parallel_for()
+// may be nested inside a task without waiting on a busy pool.
+template <typename Task>
+void parallel_for(int count, int threads, Task task) {
+  struct helpers {
+    std::atomic<int> next{0};
+    std::mutex lock;
+    std::condition_variable finished;
+    int active = 0;
+    bool closed = false;
+  };
+  auto shared = std::make_shared<helpers>();
+  auto worker = [shared, count, &task]() {
+    for (int i = shared->next++; i < count; i = shared->next++)
+      task(i);
+  };
+
+  for (int t = 1; t < std::min(threads, count); ++t) {
+    shared_workers().post([shared, worker] {
+      {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        if (shared->closed)
+          return;
+        ++shared->active;
+      }
+      worker();
+      std::lock_guard<std::mutex> guard(shared->lock);
+      if (--shared->active == 0)
+        shared->finished.notify_all();
+    });
+  }
+  worker();
+
+  std::unique_lock<std::mutex> guard(shared->lock);
+  shared->closed = true;
+  shared->finished.wait(guard, [&] { return shared->active == 0; });
+}
+
+uint32_t png_crc(const unsigned char *data, size_t length, uint32_t crc = 0) {
+  static const std::vector<uint32_t> table = [] {
+    std::vector<uint32_t> values(256);
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      values[n] = c;
+    }
+    return values;
+  }();
+
+  crc = ~crc;
+  for (size_t i = 0; i < length; ++i)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void png_chunk(std::ostream &file, const char *type, const unsigned char *data, uint32_t length) {
+  unsigned char header[8] = {
+      static_cast<unsigned char>(length >> 24), static_cast<unsigned char>(length >> 16),
+      static_cast<unsigned char>(length >> 8), static_cast<unsigned char>(length),
+      static_cast<unsigned char>(type[0]), static_cast<unsigned char>(type[1]),
+      static_cast<unsigned char>(type[2]), static_cast<unsigned char>(type[3])};
+  uint32_t crc = png_crc(data, length, png_crc(header + 4, 4));
+  unsigned char footer[4] = {
+      static_cast<unsigned char>(crc >> 24), static_cast<unsigned char>(crc >> 16),
+      static_cast<unsigned char>(crc >> 8), static_cast<unsigned char>(crc)};
+
+  file.write(reinterpret_cast<const char *>(header), 8);
+  file.write(reinterpret_cast<const char *>(data), length);
+  file.write(reinterpret_cast<const char *>(footer), 4);
+}
+
+uint32_t adler32(const unsigned char *data, size_t length) {
+  uint32_t s1 = 1, s2 = 0;
+  for (size_t i = 0; i < length;) {
+    size_t block = std::min<size_t>(length - i, 5552);
+    for (size_t end = i + block; i < end; ++i) {
+      s1 += data[i];
+      s2 += s1;
+    }
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return s2 << 16 | s1;
+}
+
+// Checksum of two buffers back to back, from their own checksums and the
+// length of the second.
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_length) {
+  uint32_t remainder = second_length % ADLER_BASE;
+  uint64_t s1 = (first & 0xffff) + (second & 0xffff) + ADLER_BASE - 1;
+  uint64_t s2 = static_cast<uint64_t>(remainder) * (first & 0xffff) % ADLER_BASE +
+                (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+  return (s2 % ADLER_BASE) << 16 | (s1 % ADLER_BASE);
+}
+
+// Returns the bit offset just past the end-of-block code of a deflate
+// block with fixed Huffman codes, the only kind stbi_zlib_compress() emits
+// besides stored blocks. Bits are numbered from the least significant bit
+// of the first byte, where the block header starts.
+size_t fixed_block_end(const unsigned char *data, size_t size) {
+  static const unsigned char length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                               2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const unsigned char distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3,
+                                                 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+                                                 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  size_t bit = 3;
+  auto next = [&]() { return bit < size * 8 ? (data[bit / 8] >> (bit++ % 8)) & 1 : (bit++, 0); };
+  // Huffman codes are packed starting from their most significant bit.
+  auto code = [&](int bits) {
+    int value = 0;
+    while (bits--)
+      value = value << 1 | next();
+    return value;
+  };
+
+  while (bit < size * 8) {
+    int value = code(7);
+    int symbol;
+    if (value <= 23) {
+      symbol = 256 + value;
+    } else {
+      value = value << 1 | next();
+      if (value >= 48 && value <= 191)
+        symbol = value - 48;
+      else if (value >= 192 && value <= 199)
+        symbol = 280 + value - 192;
+      else
+        symbol = 144 + ((value << 1 | next()) - 400);
+    }
+
+    if (symbol == 256)
+      break;
+    if (symbol > 256) {
+      bit += length_extra[symbol - 257];
+      bit += distance_extra[code(5)];
+    }
+  }
+
+  return bit;
+}
+
+// Compresses one piece of a zlib stream into raw deflate blocks. Unless
+// last is set, the final block is left open and the output ends on a byte
+// boundary with an empty stored block (a sync flush), so that pieces
+// compressed independently can be concatenated. The Adler-32 checksum of
+// the piece goes to adler.
+std::vector<unsigned char> deflate_piece(const unsigned char *data, size_t length, int level,
+                                         bool last, uint32_t &adler) {
+  std::vector<unsigned char> out;
+
+  if (level == 0) {
+    adler = adler32(data, length);
+    for (size_t i = 0; i < length || out.empty(); i += 65535) {
+      uint16_t block = std::min<size_t>(length - i, 65535);
+      out.push_back(last && i + block == length);
+      out.insert(out.end(), {static_cast<unsigned char>(block), static_cast<unsigned char>(block >> 8),
+                             static_cast<unsigned char>(~block), static_cast<unsigned char>(~block >> 8)});
+      out.insert(out.end(), data + i, data + i + block);
+    }
+    return out;
+  }
+
+  int zlib_length;
+  unsigned char *zlib = stbi_zlib_compress(const_cast<unsigned char *>(data), length,
+                                           &zlib_length, level);
+  if (zlib == nullptr)
+    return out;
+
+  const unsigned char *trailer = zlib + zlib_length - 4;
+  adler = trailer[0] << 24 | trailer[1] << 16 | trailer[2] << 8 | trailer[3];
+  out.assign(zlib + 2, zlib + zlib_length - 4);
+  STBIW_FREE(zlib);
+
+  if (last)
+    return out;
+
+  if (((out[0] >> 1) & 3) == 0) {
+    // Stored blocks: only the header of the last one has BFINAL set.
+    size_t pos = 0;
+    while (pos + 5 + (out[pos + 1] | out[pos + 2] << 8) < out.size())
+      pos += 5 + (out[pos + 1] | out[pos + 2] << 8);
+    out[pos] &= ~1;
+    return out;
+  }
+
+  out[0] &= ~1;
+  size_t end = fixed_block_end(out.data(), out.size());
+  // The stored block header takes three bits; the padding after the
+  // end-of-block code is zero and may already hold them.
+  if (out.size() * 8 - end < 3)
+    out.push_back(0);
+  out.insert(out.end(), {0, 0, 0xff, 0xff});
+  return out;
+}
+
+// Applies PNG filter type (0 none, 1 sub, 2 up, 3 average, 4 paeth) to one
+// row of bytes, with bpp bytes per pixel. prior is the unfiltered row above,
+// all zeros for the first row.
+void png_filter_row(int type, const unsigned char *row, const unsigned char *prior,
+                    size_t length, int bpp, unsigned char *out) {
+  for (size_t i = 0; i < length; ++i) {
+    int a = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+    int b = prior[i];
+    int c = i >= static_cast<size_t>(bpp) ? prior[i - bpp] : 0;
+    int predictor = 0;
+    if (type == 1) {
+      predictor = a;
+    } else if (type == 2) {
+      predictor = b;
+    } else if (type == 3) {
+      predictor = (a + b) / 2;
+    } else if (type == 4) {
+      int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+      predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+    }
+    out[i] = row[i] - predictor;
+  }
+}
+
+// filter is a PNG filter type, or -1 to pick per row the type whose output
+// has the smallest sum of absolute values, as stb_image_write does. level
+// is 0 for stored (uncompressed) data, otherwise the stbi_zlib_compress()
+// quality, where higher searches longer for matches (values below 5 act as 5).
+struct png_options {
+  int level = DEFAULT_COMPRESSION;
+  int filter = -1;
+  int threads = 1;
+};
+
+// Filtering and compression are split over options.threads threads; the
+// image data is compressed in independent pieces of DEFLATE_PIECE_SIZE
+// bytes, joined as pigz does. 16-bit samples are written big-endian.
+// Returns 0 on failure like stbi_write_*.
+template <typename T>
+int write_png(std::ostream &file, int width, int height, int channels, const T *data,
+              const png_options &options) {
+  static const unsigned char color_types[] = {0, 0, 4, 2, 6};
+  int bpp = channels * sizeof(T);
+  size_t line = static_cast<size_t>(width) * bpp;
+  size_t row_size = line + 1;
+  std::vector<unsigned char> raw(row_size * height);
+
+  auto row_bytes = [&](int y, unsigned char *out) {
+    const T *row = data + static_cast<size_t>(y) * width * channels;
+    for (int x = 0; x < width * channels; ++x) {
+      if constexpr (sizeof(T) == 1) {
+        out[x] = row[x];
+      } else {
+        out[2 * x] = row[x] >> 8;
+        out[2 * x + 1] = row[x] & 0xff;
+      }
+    }
+  };
+
+  int bands = std::min(height, options.threads * 4);
+  parallel_for(bands, options.threads, [&](int band) {
+    std::vector<unsigned char> prior(line), current(line), candidate(line);
+    int first = static_cast<long>(height) * band / bands;
+    int last = static_cast<long>(height) * (band + 1) / bands;
+    if (first > 0)
+      row_bytes(first - 1, prior.data());
+
+    for (int y = first; y < last; ++y) {
+      row_bytes(y, current.data());
+      unsigned char *out = raw.data() + y * row_size;
+
+      int type = options.filter;
+      if (type < 0) {
+        long best = -1;
+        for (int t = 0; t < 5; ++t) {
+          png_filter_row(t, current.data(), prior.data(), line, bpp, candidate.data());
+          long sum = 0;
+          for (size_t i = 0; i < line; ++i)
+            sum += std::abs(static_cast<signed char>(candidate[i]));
+          if (best < 0 || sum < best) {
+            best = sum;
+            type = t;
+          }
+        }
+      }
+
+      out[0] = type;
+      png_filter_row(type, current.data(), prior.data(), line, bpp, out + 1);
+      std::swap(prior, current);
+    }
+  });
+
+  size_t piece_count = (raw.size() + DEFLATE_PIECE_SIZE - 1) / DEFLATE_PIECE_SIZE;
+  std::vector<std::vector<unsigned char>> pieces(piece_count);
+  std::vector<uint32_t> checksums(piece_count);
+  parallel_for(piece_count, options.threads, [&](int i) {
+    size_t offset = static_cast<size_t>(i) * DEFLATE_PIECE_SIZE;
+    size_t length = std::min<size_t>(DEFLATE_PIECE_SIZE, raw.size() - offset);
+    pieces[i] = deflate_piece(raw.data() + offset, length, options.level,
+                              i + 1 == static_cast<int>(piece_count), checksums[i]);
+  });
+
+  std::vector<unsigned char> zlib = {0x78, 0x5e};
+  uint32_t adler = 1;
+  for (size_t i = 0; i < piece_count; ++i) {
+    if (pieces[i].empty())
+      return 0;
+    zlib.insert(zlib.end(), pieces[i].begin(), pieces[i].end());
+    size_t length = std::min<size_t>(DEFLATE_PIECE_SIZE, raw.size() - i * DEFLATE_PIECE_SIZE);
+    adler = adler32_combine(adler, checksums[i], length);
+  }
+  zlib.insert(zlib.end(), {static_cast<unsigned char>(adler >> 24), static_cast<unsigned char>(adler >> 16),
+                           static_cast<unsigned char>(adler >> 8), static_cast<unsigned char>(adler)});
+
+  unsigned char ihdr[13] = {
+      static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+      static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+      static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+      static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+      8 * sizeof(T), color_types[channels], 0, 0, 0};
+
+  file.write("\x89PNG\r\n\x1a\n", 8);
+  png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+  png_chunk(file, "IDAT", zlib.data(), zlib.size());
+  png_chunk(file, "IEND", nullptr, 0);
+
+  return file.good();
+}
+
+template <typename T>
+int write_png(const char *filename, int width, int height, int channels, const T *data,
+              const png_options &options) {
+  std::ofstream file(filename, std::ios::binary);
+  return file && write_png(file, width, height, channels, data, options);
+}
+
+// subsampling is 444, 422 or 420 for the chroma resolution, or 0 to let the
+// quality decide as stb_image_write does (4:2:0 up to 90, 4:4:4 above).
+struct jpeg_options {
+  int quality = DEFAULT_QUALITY;
+  int subsampling = 0;
+  int threads = 1;
+};
+
+// Builds the code and length of every symbol from a Huffman table given as
+// the number of codes of each length from 1 to 16 and the symbols in order.
+void jpeg_huffman_codes(const unsigned char *counts, const unsigned char *symbols,
+                        unsigned short table[256][2]) {
+  int code = 0, k = 0;
+  for (int length = 1; length <= 16; ++length, code <<= 1) {
+    for (int i = 0; i < counts[length - 1]; ++i, ++code) {
+      table[symbols[k]][0] = code;
+      table[symbols[k++]][1] = length;
+    }
+  }
+}
+
+// Baseline JPEG encoder built from stb_image_write's DCT and entropy coder,
+// with a choice of chroma subsampling. Every row of MCUs is a restart
+// interval, coded on its own from fresh DC predictions, so the rows are
+// encoded in parallel on options.threads threads and joined with RST
+// markers. Alpha is ignored. Returns 0 on failure like stbi_write_*.
+int write_jpg(std::ostream &file, int width, int height, int channels,
+              const unsigned char *data, const jpeg_options &options) {
+  // The typical tables from Annex K of the JPEG standard, as stb uses them.
+  static const unsigned char dc_luma_counts[] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+  static const unsigned char dc_chroma_counts[] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+  static const unsigned char dc_symbols[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+  static const unsigned char ac_luma_counts[] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+  static const unsigned char ac_luma_symbols[] = {
+      0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+      0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+      0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+      0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa};
+  static const unsigned char ac_chroma_counts[] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+  static const unsigned char ac_chroma_symbols[] = {
+      0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+      0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+      0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+      0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa};
+  static const int luma_quant[] = {
+      16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55, 14, 13, 16, 24, 40, 57,
+      69, 56, 14, 17, 22, 29, 51, 87, 80, 62, 18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64,
+      81, 104, 113, 92, 49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+  static const int chroma_quant[] = {
+      17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99,
+      99, 99, 47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+      99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+  // DCT scale factors folded into the quantizer, as in stb_image_write.
+  static const float dct_scale[] = {
+      1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f,
+      1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f,
+      0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f};
+
+  // Built once, even when several images are encoded at the same time.
+  static unsigned short dc_luma[256][2], dc_chroma[256][2], ac_luma[256][2], ac_chroma[256][2];
+  static std::once_flag huffman_once;
+  std::call_once(huffman_once, [] {
+    jpeg_huffman_codes(dc_luma_counts, dc_symbols, dc_luma);
+    jpeg_huffman_codes(dc_chroma_counts, dc_symbols, dc_chroma);
+    jpeg_huffman_codes(ac_luma_counts, ac_luma_symbols, ac_luma);
+    jpeg_huffman_codes(ac_chroma_counts, ac_chroma_symbols, ac_chroma);
+  });
+
+  int quality = std::clamp(options.quality, 1, 100);
+  int subsampling = options.subsampling ? options.subsampling : quality <= 90 ? 420 : 444;
+  int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  unsigned char luma_table[64], chroma_table[64];
+  for (int i = 0; i < 64; ++i) {
+    luma_table[stbiw__jpg_ZigZag[i]] = std::clamp((luma_quant[i] * scale + 50) / 100, 1, 255);
+    chroma_table[stbiw__jpg_ZigZag[i]] = std::clamp((chroma_quant[i] * scale + 50) / 100, 1, 255);
+  }
+
+  float luma_divisors[64], chroma_divisors[64];
+  for (int k = 0; k < 64; ++k) {
+    float factor = dct_scale[k / 8] * dct_scale[k % 8];
+    luma_divisors[k] = 1 / (luma_table[stbiw__jpg_ZigZag[k]] * factor);
+    chroma_divisors[k] = 1 / (chroma_table[stbiw__jpg_ZigZag[k]] * factor);
+  }
+
+  int mcu_width = subsampling == 444 ? 8 : 16;
+  int mcu_height = subsampling == 420 ? 16 : 8;
+  int mcus_per_row = (width + mcu_width - 1) / mcu_width;
+  int mcu_rows = (height + mcu_height - 1) / mcu_height;
+  if (mcus_per_row > 65535)
+    return 0;
+
+  auto append = [](void *context, void *bytes, int size) {
+    auto *out = static_cast<std::vector<unsigned char> *>(context);
+    out->insert(out->end(), static_cast<unsigned char *>(bytes), static_cast<unsigned char *>(bytes) + size);
+  };
+
+  std::vector<std::vector<unsigned char>> segments(mcu_rows);
+  parallel_for(mcu_rows, options.threads, [&](int mcu_row) {
+    stbi__write_context context = {};
+    stbi__start_write_callbacks(&context, append, &segments[mcu_row]);
+    int bit_buffer = 0, bit_count = 0;
+    int dc_y = 0, dc_u = 0, dc_v = 0;
+    float y_block[256], u_block[256], v_block[256], u_sub[64], v_sub[64];
+
+    for (int mcu = 0; mcu < mcus_per_row; ++mcu) {
+      int x0 = mcu * mcu_width, y0 = mcu_row * mcu_height;
+      for (int row = 0, pos = 0; row < mcu_height; ++row) {
+        const unsigned char *line = data + static_cast<size_t>(std::min(y0 + row, height - 1)) * width * channels;
+        for (int col = 0; col < mcu_width; ++col, ++pos) {
+          const unsigned char *pixel = line + std::min(x0 + col, width - 1) * channels;
+          float r = pixel[0], g = pixel[channels > 2 ? 1 : 0], b = pixel[channels > 2 ? 2 : 0];
+          y_block[pos] = 0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+          u_block[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+          v_block[pos] = 0.50000f * r - 0.41869f * g - 0.08131f * b;
+        }
+      }
+
+      for (int by = 0; by < mcu_height; by += 8)
+        for (int bx = 0; bx < mcu_width; bx += 8)
+          dc_y = stbiw__jpg_processDU(&context, &bit_buffer, &bit_count, y_block + by * mcu_width + bx,
+                                      mcu_width, luma_divisors, dc_y, dc_luma, ac_luma);
+
+      float *u = u_block, *v = v_block;
+      if (subsampling != 444) {
+        for (int yy = 0, pos = 0; yy < 8; ++yy) {
+          for (int xx = 0; xx < 8; ++xx, ++pos) {
+            int j = (subsampling == 420 ? 2 * yy : yy) * 16 + 2 * xx;
+            if (subsampling == 420) {
+              u_sub[pos] = (u_block[j] + u_block[j + 1] + u_block[j + 16] + u_block[j + 17]) * 0.25f;
+              v_sub[pos] = (v_block[j] + v_block[j + 1] + v_block[j + 16] + v_block[j + 17]) * 0.25f;
+            } else {
+              u_sub[pos] = (u_block[j] + u_block[j + 1]) * 0.5f;
+              v_sub[pos] = (v_block[j] + v_block[j + 1]) * 0.5f;
+            }
+          }
+        }
+        u = u_sub;
+        v = v_sub;
+      }
+      dc_u = stbiw__jpg_processDU(&context, &bit_buffer, &bit_count, u, 8, chroma_divisors, dc_u, dc_chroma, ac_chroma);
+      dc_v = stbiw__jpg_processDU(&context, &bit_buffer, &bit_count, v, 8, chroma_divisors, dc_v, dc_chroma, ac_chroma);
+    }
+
+    // Pad the last byte with ones, then mark the end of the interval.
+    static const unsigned short fill_bits[] = {0x7f, 7};
+    stbiw__jpg_writeBits(&context, &bit_buffer, &bit_count, fill_bits);
+    if (mcu_row + 1 < mcu_rows)
+      segments[mcu_row].insert(segments[mcu_row].end(), {0xff, static_cast<unsigned char>(0xd0 + mcu_row % 8)});
+  });
+
+  auto put = [&](std::initializer_list<unsigned char> bytes) {
+    for (unsigned char byte : bytes)
+      file.put(byte);
+  };
+  auto put_table = [&](const unsigned char *bytes, size_t size) {
+    file.write(reinterpret_cast<const char *>(bytes), size);
+  };
+  auto hi = [](int value) { return static_cast<unsigned char>(value >> 8); };
+  auto lo = [](int value) { return static_cast<unsigned char>(value); };
+
+  put({0xff, 0xd8, 0xff, 0xe0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+  put({0xff, 0xdb, 0, 0x84, 0});
+  put_table(luma_table, 64);
+  put({1});
+  put_table(chroma_table, 64);
+  unsigned char luma_sampling = subsampling == 444 ? 0x11 : subsampling == 422 ? 0x21 : 0x22;
+  put({0xff, 0xc0, 0, 0x11, 8, hi(height), lo(height), hi(width), lo(width),
+       3, 1, luma_sampling, 0, 2, 0x11, 1, 3, 0x11, 1});
+  put({0xff, 0xdd, 0, 4, hi(mcus_per_row), lo(mcus_per_row)});
+  put({0xff, 0xc4, 0x01, 0xa2, 0x00});
+  put_table(dc_luma_counts, 16);
+  put_table(dc_symbols, sizeof(dc_symbols));
+  put({0x10});
+  put_table(ac_luma_counts, 16);
+  put_table(ac_luma_symbols, sizeof(ac_luma_symbols));
+  put({0x01});
+  put_table(dc_chroma_counts, 16);
+  put_table(dc_symbols, sizeof(dc_symbols));
+  put({0x11});
+  put_table(ac_chroma_counts, 16);
+  put_table(ac_chroma_symbols, sizeof(ac_chroma_symbols));
+  put({0xff, 0xda, 0, 0xc, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3f, 0});
+  for (const auto &segment : segments)
+    put_table(segment.data(), segment.size());
+  put({0xff, 0xd9});
+
+  return file.good();
+}
+
+int write_jpg(const char *filename, int width, int height, int channels,
+              const unsigned char *data, const jpeg_options &options) {
+  std::ofstream file(filename, std::ios::binary);
+  return file && write_jpg(file, width, height, channels, data, options);
+}
+
+// Uncompressed formats are not decoded: the file is memory mapped and
+// samples are read from and written to the page cache in place.
+struct mapped_file {
+  unsigned char *data = nullptr;
+  size_t size = 0;
+  // A file being created is written under temp_path and only renamed to
+  // path by commit_mapped_file(), so an output that is also the input is
+  // not truncated while it is still being read.
+  std::string path;
+  std::string temp_path;
+
+  mapped_file() = default;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() { unmap_file(*this); }
+
+  // Unmaps the file, removing it if it was created and not committed.
+  friend void unmap_file(mapped_file &file) {
+    if (file.data != nullptr)
+      munmap(file.data, file.size);
+    if (!file.temp_path.empty())
+      unlink(file.temp_path.c_str());
+    file.data = nullptr;
+    file.size = 0;
+    file.path.clear();
+    file.temp_path.clear();
+  }
+};
+
+bool map_file(const std::string &path, mapped_file &file) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat info;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0)
+    data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  madvise(data, info.st_size, MADV_SEQUENTIAL);
+  file.data = static_cast<unsigned char *>(data);
+  file.size = info.st_size;
+  return true;
+}
+
+// An empty path maps anonymous memory instead, for images that are sent or
+// received rather than stored.
+bool create_mapped_file(const std::string &path, size_t size, mapped_file &file) {
+  if (path.empty()) {
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED)
+      return false;
+    file.data = static_cast<unsigned char *>(data);
+    file.size = size;
+    return true;
+  }
+
+  // Created next to path so that the rename stays on one file system.
+  static std::atomic<unsigned> created{0};
+  std::string temp_path = path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(created++);
+  int fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0)
+    return false;
+
+  void *data = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  file.data = static_cast<unsigned char *>(data);
+  file.size = size;
+  file.path = path;
+  file.temp_path = temp_path;
+  return true;
+}
+
+// Replaces file.path with the file written by create_mapped_file().
+bool commit_mapped_file(mapped_file &file) {
+  if (file.temp_path.empty())
+    return true;
+  if (rename(file.temp_path.c_str(), file.path.c_str()) != 0)
+    return false;
+  file.temp_path.clear();
+  return true;
+}
+
+// An image stored uncompressed at offset in a mapped file: binary PGM/PPM
+// (P5/P6, maxval 255 or 65535, big-endian), PFM (Pf/PF, bottom row first)
+// or raw (RAW_MAGIC, then int32 width, height, channels and bit depth, then
+// interleaved samples in host order). swap is set when samples are not in
+// host byte order.
+struct mapped_image {
+  mapped_file file;
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  int depth = 0;
+  size_t offset = 0;
+  bool bottom_up = false;
+  bool swap = false;
+};
+
+bool host_big_endian() {
+  uint16_t probe = 1;
+  return *reinterpret_cast<unsigned char *>(&probe) == 0;
+}
+
+void swap_samples(unsigned char *data, size_t samples, int bytes) {
+  for (size_t x = 0; x < samples; ++x)
+    std::reverse(data + x * bytes, data + (x + 1) * bytes);
+}
+
+// Reads the next whitespace-separated PNM/PFM header field, skipping
+// comments.
+bool header_field(const mapped_file &file, size_t &pos, std::string &field) {
+  while (pos < file.size && (std::isspace(file.data[pos]) || file.data[pos] == '#')) {
+    if (file.data[pos] == '#') {
+      while (pos < file.size && file.data[pos] != '\n')
+        ++pos;
+    } else {
+      ++pos;
+    }
+  }
+
+  size_t start = pos;
+  while (pos < file.size && !std::isspace(file.data[pos]))
+    ++pos;
+  field.assign(reinterpret_cast<const char *>(file.data) + start, pos - start);
+  return !field.empty();
+}
+
+// Reads the header of the image in image.file. Returns false, leaving
+// nothing mapped, if it is not one of the formats described at
+// mapped_image.
+bool parse_mapped_image(mapped_image &image) {
+  mapped_file &file = image.file;
+
+  if (file.size >= 20 && std::memcmp(file.data, RAW_MAGIC, 4) == 0) {
+    int32_t fields[4];
+    std::memcpy(fields, file.data + 4, sizeof(fields));
+    image.width = fields[0];
+    image.height = fields[1];
+    image.channels = fields[2];
+    image.depth = fields[3];
+    image.offset = 20;
+  } else if (file.size >= 2 && file.data[0] == 'P' && std::strchr("56fF", file.data[1])) {
+    std::string magic, width, height, range;
+    size_t pos = 0;
+    if (header_field(file, pos, magic) && header_field(file, pos, width) &&
+        header_field(file, pos, height) && header_field(file, pos, range)) {
+      image.width = std::atoi(width.c_str());
+      image.height = std::atoi(height.c_str());
+      image.offset = pos + 1;
+
+      if (magic == "P5" || magic == "P6") {
+        int maxval = std::atoi(range.c_str());
+        image.channels = magic == "P5" ? 1 : 3;
+        image.depth = maxval == 255 ? 8 : maxval == 65535 ? 16 : 0;
+        image.swap = image.depth == 16 && !host_big_endian();
+      } else if (magic == "Pf" || magic == "PF") {
+        // A negative scale marks little-endian samples.
+        image.channels = magic == "Pf" ? 1 : 3;
+        image.depth = 32;
+        image.bottom_up = true;
+        image.swap = (std::atof(range.c_str()) < 0) == host_big_endian();
+      }
+    }
+  }
+
+  bool valid = image.width > 0 && image.height > 0 && image.channels >= 1 &&
+               image.channels <= 4 &&
+               (image.depth == 8 || image.depth == 16 || image.depth == 32) &&
+               image.offset + static_cast<size_t>(image.width) * image.height *
+                                  image.channels * (image.depth / 8) <= file.size;
+  if (!valid)
+    unmap_file(file);
+  return valid;
+}
+
+bool map_image(const std::string &path, mapped_image &image) {
+  return map_file(path, image.file) && parse_mapped_image(image);
+}
+
+// map_image() for an image held in memory, copied into an anonymous
+// mapping.
+bool map_image(const std::vector<unsigned char> &bytes, mapped_image &image) {
+  if (bytes.empty() || !create_mapped_file("", bytes.size(), image.file))
+    return false;
+  std::memcpy(image.file.data, bytes.data(), bytes.size());
+  return parse_mapped_image(image);
+}
+
+// Creates a file holding width x height pixels in the format named by
+// extension (ppm, pgm, pnm, pfm or raw) and maps it for writing. Samples are
+// written in host order: swap says whether a row needs swap_samples() once
+// it is filled. Headers are padded so that rows start aligned for their
+// sample type.
+bool create_mapped_image(const std::string &path, const std::string &extension,
+                         int width, int height, int channels, int depth,
+                         mapped_image &image) {
+  std::string header;
+  if (extension == "raw") {
+    int32_t fields[4] = {width, height, channels, depth};
+    header.assign(RAW_MAGIC, 4);
+    header.append(reinterpret_cast<const char *>(fields), sizeof(fields));
+  } else {
+    std::string magic = extension == "pfm" ? (channels == 1 ? "Pf" : "PF")
+                                           : (channels == 1 ? "P5" : "P6");
+    std::string range = extension == "pfm" ? (host_big_endian() ? "1.0" : "-1.0")
+                                           : (depth == 16 ? "65535" : "255");
+    header = magic + "\n" + std::to_string(width) + " " + std::to_string(height);
+    size_t length = header.size() + range.size() + 2;
+    header.append((16 - length % 16) % 16, ' ');
+    header += "\n" + range + "\n";
+    image.swap = extension != "pfm" && depth == 16 && !host_big_endian();
+    image.bottom_up = extension == "pfm";
+  }
+
+  image.width = width;
+  image.height = height;
+  image.channels = channels;
+  image.depth = depth;
+  image.offset = header.size();
+
+  size_t size = image.offset + static_cast<size_t>(width) * height * channels * (depth / 8);
+  if (!create_mapped_file(path, size, image.file))
+    return false;
+  std::memcpy(image.file.data, header.data(), header.size());
+  return true;
+}
+
+size_t mapped_row_bytes(const mapped_image &image) {
+  return static_cast<size_t>(image.width) * image.channels * (image.depth / 8);
+}
+
+// Row y counted from the top, as stored in the file.
+unsigned char *mapped_row(const mapped_image &image, int y) {
+  int row = image.bottom_up ? image.height - 1 - y : y;
+  return image.file.data + image.offset + row * mapped_row_bytes(image);
+}
+
+template <typename T>
+void gray_row(const T *src, T *dst, int width, int channels) {
+  int gray_channels = has_alpha(channels) ? 2 : 1;
+  for (int j = 0; j < width; ++j) {
+    const T *pixel = src + j * channels;
+    T alpha = pixel[channels - 1];
+    if constexpr (std::is_floating_point_v<T>)
+      dst[j * gray_channels] = (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) / 256;
+    else
+      dst[j * gray_channels] = (pixel[0] * 77u + pixel[1] * 150u + pixel[2] * 29u) >> 8;
+    if (gray_channels == 2)
+      dst[j * gray_channels + 1] = alpha;
+  }
+}
+
+// Returns row y top to bottom, in host byte order and, with gray, converted
+// to luminance as stb_image does (alpha is kept). Rows already in that form
+// and suitably aligned are returned in place, others are converted into
+// scratch.
+const unsigned char *read_mapped_row(const mapped_image &image, int y, bool gray,
+                                     std::vector<unsigned char> &scratch) {
+  int bytes = image.depth / 8;
+  const unsigned char *row = mapped_row(image, y);
+  bool to_gray = gray && image.channels >= 3;
+  if (!image.swap && !to_gray && reinterpret_cast<uintptr_t>(row) % bytes == 0)
+    return row;
+
+  size_t samples = static_cast<size_t>(image.width) * image.channels;
+  scratch.resize(samples * bytes);
+  std::memcpy(scratch.data(), row, scratch.size());
+  if (image.swap)
+    swap_samples(scratch.data(), samples, bytes);
+
+  if (to_gray && image.depth == 32) {
+    float *data = reinterpret_cast<float *>(scratch.data());
+    gray_row(data, data, image.width, image.channels);
+  } else if (to_gray && image.depth == 16) {
+    uint16_t *data = reinterpret_cast<uint16_t *>(scratch.data());
+    gray_row(data, data, image.width, image.channels);
+  } else if (to_gray) {
+    gray_row(scratch.data(), scratch.data(), image.width, image.channels);
+  }
+  return scratch.data();
+}
+
+// Returns the whole image top to bottom as read_mapped_row() does: the
+// mapping itself when it can be used as it is, otherwise a converted copy
+// that must be released with stbi_image_free(), in which case copied is set.
+void *read_mapped_image(const mapped_image &image, bool gray, bool &copied) {
+  std::vector<unsigned char> scratch;
+  const unsigned char *first = read_mapped_row(image, 0, gray, scratch);
+  copied = first == scratch.data() || image.bottom_up;
+  if (!copied)
+    return const_cast<unsigned char *>(first);
+
+  int channels = gray && image.channels >= 3 ? (has_alpha(image.channels) ? 2 : 1) : image.channels;
+  size_t row_bytes = static_cast<size_t>(image.width) * channels * (image.depth / 8);
+  unsigned char *data = static_cast<unsigned char *>(STBI_MALLOC(row_bytes * image.height));
+  if (data == nullptr)
+    return nullptr;
+
+  for (int i = 0; i < image.height; ++i)
+    std::memcpy(data + i * row_bytes, read_mapped_row(image, i, gray, scratch), row_bytes);
+  return data;
+}
+
+struct blur_options {
+  std::string algorithm = DEFAULT_ALGORITHM;
+  int strength = DEFAULT_STRENGTH;
+  float sigma_space = DEFAULT_SIGMA_SPACE;
+  float sigma_range = DEFAULT_SIGMA_RANGE;
+  std::string motion_direction;
+  int blades = 0;
+  std::vector<std::vector<float>> custom_kernel;
+  std::vector<separable_term> custom_terms;
+  bool fixed = false;
+  storage_format intermediate = storage_format::fp32;
+  bool linear = false;
+  bool ycbcr = false;
+  int chroma_strength = DEFAULT_STRENGTH;
+  bool chroma_half = false;
+  bool pyramid = true;
+};
+
+// Power of two by which a gaussian of options.strength is reduced before
+// blurring: 1 below PYRAMID_MIN_STRENGTH, otherwise the largest factor that
+// leaves a kernel of PYRAMID_LEVEL_STRENGTH at the coarsest level.
+int pyramid_factor(const blur_options &options) {
+  if (!options.pyramid || options.algorithm != "gaussian" || options.strength < PYRAMID_MIN_STRENGTH)
+    return 1;
+  int factor = 1;
+  while (options.strength / (factor * 2) >= PYRAMID_LEVEL_STRENGTH)
+    factor *= 2;
+  return factor;
+}
+
+std::vector<std::vector<std::vector<float>>>
+pyramid_blur(const std::vector<std::vector<std::vector<float>>> &image,
+             const blur_options &options, int factor);
+
+std::vector<std::vector<std::vector<float>>>
+blur_ycbcr(const std::vector<std::vector<std::vector<float>>> &image,
+           const blur_options &options,
+           const std::vector<std::vector<float>> &radius_map);
+
+std::vector<std::vector<std::vector<float>>>
+blur_image(const std::vector<std::vector<std::vector<float>>> &image,
+           const blur_options &options,
+           const std::vector<std::vector<float>> &radius_map) {
+  int channels = image[0][0].size();
+  int strength = options.strength;
+  const std::string &algorithm = options.algorithm;
+
+  if (options.ycbcr && channels >= 3)
+    return blur_ycbcr(image, options, radius_map);
+
+  if (algorithm == "gaussian" && pyramid_factor(options) > 1)
+    return pyramid_blur(image, options, pyramid_factor(options));
+  else if (algorithm == "gaussian")
+    return separable_conv(image, gaussian_weights(strength), gaussian_weights(strength), options.intermediate);
+  else if (algorithm == "box")
+    return separable_conv(image, box_weights(strength), box_weights(strength), options.intermediate);
+  else if (algorithm == "bilateral")
+    return bilateral_conv(image, bilateral_kernel(image, strength, options.sigma_space, options.sigma_range, channels), options.sigma_range);
+  else if (algorithm == "median")
+    return median_filter(image, strength);
+  else if (algorithm == "motion")
+    return conv(image, motion_kernel(strength, options.motion_direction, channels));
+  else if (algorithm == "lens")
+    return lens_blur(image, lens_spans(strength, options.blades));
+  else if (algorithm == "custom")
+    return custom_conv(image, options.custom_kernel, options.custom_terms, options.intermediate);
+  else if (algorithm == "variable")
+    return variable_blur(image, radius_map, strength);
+
+  return image;
+}
+
+// Halves both dimensions by averaging 2x2 blocks; odd edges repeat the last
+// row or column.
+std::vector<std::vector<std::vector<float>>>
+downsample_image(const std::vector<std::vector<std::vector<float>>> &image) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+  int Ho = (Hi + 1) / 2;
+  int Wo = (Wi + 1) / 2;
+
+  std::vector<std::vector<std::vector<float>>> out(
+      Ho, std::vector<std::vector<float>>(Wo, std::vector<float>(channels, 0)));
+
+  for (int i = 0; i < Ho; ++i) {
+    int i0 = 2 * i, i1 = std::min(2 * i + 1, Hi - 1);
+    for (int j = 0; j < Wo; ++j) {
+      int j0 = 2 * j, j1 = std::min(2 * j + 1, Wi - 1);
+      for (int c = 0; c < channels; ++c) {
+        out[i][j][c] = 0.25f * (image[i0][j0][c] + image[i0][j1][c] +
+                                image[i1][j0][c] + image[i1][j1][c]);
+      }
+    }
+  }
+
+  return out;
+}
+
+// Bilinear upsampling of an image reduced by factor back to height x width,
+// with sample centers aligned the way downsample_image() and
+// unflatten_reduced() placed them.
+std::vector<std::vector<std::vector<float>>>
+upsample_image(const std::vector<std::vector<std::vector<float>>> &image, int height, int width,
+               int factor = 2) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int channels = image[0][0].size();
+
+  std::vector<std::vector<std::vector<float>>> out(
+      height, std::vector<std::vector<float>>(width, std::vector<float>(channels, 0)));
+
+  for (int i = 0; i < height; ++i) {
+    float y = std::clamp((i + 0.5f) / factor - 0.5f, 0.0f, Hi - 1.0f);
+    int y0 = static_cast<int>(y), y1 = std::min(y0 + 1, Hi - 1);
+    float fy = y - y0;
+    for (int j = 0; j < width; ++j) {
+      float x = std::clamp((j + 0.5f) / factor - 0.5f, 0.0f, Wi - 1.0f);
+      int x0 = static_cast<int>(x), x1 = std::min(x0 + 1, Wi - 1);
+      float fx = x - x0;
+      for (int c = 0; c < channels; ++c) {
+        float top = image[y0][x0][c] + (image[y0][x1][c] - image[y0][x0][c]) * fx;
+        float bottom = image[y1][x0][c] + (image[y1][x1][c] - image[y1][x0][c]) * fx;
+        out[i][j][c] = top + (bottom - top) * fy;
+      }
+    }
+  }
+
+  return out;
+}
+
+// Gaussian blur through an image pyramid: the image is halved until it is
+// 1/factor of its size, blurred there with a kernel 1/factor as wide, and
+// brought back up one level at a time so that the bilinear steps stay
+// smooth. The cost falls with the square of factor.
+std::vector<std::vector<std::vector<float>>>
+pyramid_blur(const std::vector<std::vector<std::vector<float>>> &image,
+             const blur_options &options, int factor) {
+  std::vector<std::pair<int, int>> sizes;
+  std::vector<std::vector<std::vector<float>>> level;
+
+  for (int f = 1; f < factor; f *= 2) {
+    const auto &source = f == 1 ? image : level;
+    sizes.emplace_back(source.size(), source[0].size());
+    level = downsample_image(source);
+  }
+
+  std::vector<float> weights = gaussian_weights(std::max(1, options.strength / factor));
+  level = separable_conv(level, weights, weights, options.intermediate);
+
+  for (auto size = sizes.rbegin(); size != sizes.rend(); ++size)
+    level = upsample_image(level, size->first, size->second);
+
+  return level;
+}
+
+// Blurs luma with options.strength and chroma with options.chroma_strength,
+// in JPEG (full range BT.601) YCbCr. A strength of 1 or less leaves the
+// plane as it is. With chroma_half the chroma planes are blurred at half
+// resolution with half the strength, a quarter of the work. Alpha, if any,
+// is blurred along with luma, since the colors it premultiplies are.
+std::vector<std::vector<std::vector<float>>>
+blur_ycbcr(const std::vector<std::vector<std::vector<float>>> &image,
+           const blur_options &options,
+           const std::vector<std::vector<float>> &radius_map) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  bool alpha = image[0][0].size() == 4;
+
+  std::vector<std::vector<std::vector<float>>> luma(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(1 + alpha)));
+  std::vector<std::vector<std::vector<float>>> chroma(
+      Hi, std::vector<std::vector<float>>(Wi, std::vector<float>(2)));
+
+  for (int i = 0; i < Hi; ++i) {
+    for (int j = 0; j < Wi; ++j) {
+      float r = image[i][j][0], g = image[i][j][1], b = image[i][j][2];
+      luma[i][j][0] = 0.299f * r + 0.587f * g + 0.114f * b;
+      if (alpha)
+        luma[i][j][1] = image[i][j][3];
+      chroma[i][j][0] = 128 - 0.168736f * r - 0.331264f * g + 0.5f * b;
+      chroma[i][j][1] = 128 + 0.5f * r - 0.418688f * g - 0.081312f * b;
+    }
+  }
+
+  blur_options plane_options = options;
+  plane_options.ycbcr = false;
+
+  if (options.strength > 1)
+    luma = blur_image(luma, plane_options, radius_map);
+
+  if (options.chroma_strength > 1 && options.chroma_half) {
+    plane_options.strength = std::max(1, options.chroma_strength / 2);
+    std::vector<std::vector<float>> half_map;
+    if (!radius_map.empty()) {
+      for (int i = 0; i < Hi; i += 2) {
+        half_map.emplace_back();
+        for (int j = 0; j < Wi; j += 2)
+          half_map.back().push_back(radius_map[i][j]);
+      }
+    }
+    chroma = upsample_image(blur_image(downsample_image(chroma), plane_options, half_map), Hi, Wi);
+  } else if (options.chroma_strength > 1) {
+    plane_options.strength = options.chroma_strength;
+    chroma = blur_image(chroma, plane_options, radius_map);
+  }
+
+  std::vector<std::vector<std::vector<float>>> out = image;
+
+  for (int i = 0; i < Hi; ++i) {
+    for (int j = 0; j < Wi; ++j) {
+      float y = luma[i][j][0], cb = chroma[i][j][0] - 128, cr = chroma[i][j][1] - 128;
+      out[i][j][0] = y + 1.402f * cr;
+      out[i][j][1] = y - 0.344136f * cb - 0.714136f * cr;
+      out[i][j][2] = y + 1.772f * cb;
+      if (alpha)
+        out[i][j][3] = luma[i][j][1];
+    }
+  }
+
+  return out;
+}
+
+// blur_image() followed by flatten_image(). Separable algorithms quantize
+// inside their last pass instead of producing a float image first.
+template <typename T>
+std::vector<T>
+blur_image_quantized(const std::vector<std::vector<std::vector<float>>> &image,
+                     const blur_options &options,
+                     const std::vector<std::vector<float>> &radius_map,
+                     const output_encoding &encoding) {
+  int height = image.size();
+  int width = image[0].size();
+
+  if ((options.algorithm == "gaussian" || options.algorithm == "box") && !options.ycbcr &&
+      pyramid_factor(options) == 1) {
+    std::vector<float> weights = options.algorithm == "gaussian"
+        ? gaussian_weights(options.strength)
+        : box_weights(options.strength);
+    return separable_conv_quantized<T>(image, weights, weights, options.intermediate,
+                                       encoding);
+  }
+
+  return flatten_image<T>(blur_image(image, options, radius_map), width, height,
+                          encoding);
+}
+
+// blur_image() followed by resampling to height x width. Gaussian and box
+// blurs are fused into the resampling taps, so only the result is ever held
+// at the output size; other algorithms blur at full resolution first.
+std::vector<std::vector<std::vector<float>>>
+blur_resized(const std::vector<std::vector<std::vector<float>>> &image,
+             const blur_options &options,
+             const std::vector<std::vector<float>> &radius_map, int height, int width) {
+  if ((options.algorithm == "gaussian" || options.algorithm == "box") && !options.ycbcr &&
+      pyramid_factor(options) == 1) {
+    std::vector<float> weights = options.algorithm == "gaussian"
+        ? gaussian_weights(options.strength)
+        : box_weights(options.strength);
+    return separable_resample(image, weights, weights, height, width);
+  }
+
+  return separable_resample(blur_image(image, options, radius_map), {1.0f}, {1.0f}, height, width);
+}
+
+// Number of pixels around a region that the algorithm reads, so that a
+// cropped region blurs exactly as it would inside the full image.
+int blur_apron(const blur_options &options) {
+  int apron = options.strength;
+  if (options.ycbcr)
+    apron = std::max(apron, options.chroma_strength);
+  // Half-resolution chroma also reads a pixel or two further when resampling.
+  if (options.ycbcr && options.chroma_half)
+    apron += 2;
+  if (!options.custom_kernel.empty())
+    apron = std::max<int>(options.custom_kernel.size(), options.custom_kernel[0].size());
+  return apron;
+}
+
+// Row and column multiple that a crop must start on to blur exactly as it
+// would inside the full image, because of the reduced-resolution grids that
+// the pyramid and half-resolution chroma sample on.
+int blur_alignment(const blur_options &options) {
+  int alignment = pyramid_factor(options);
+  if (options.ycbcr) {
+    blur_options chroma = options;
+    chroma.strength = options.chroma_half ? std::max(1, options.chroma_strength / 2) : options.chroma_strength;
+    alignment = std::max(alignment, pyramid_factor(chroma) * (options.chroma_half ? 2 : 1));
+  }
+  return alignment;
+}
+
+// Multiplies colors by alpha in place, rounding to nearest, or divides them
+// back out with unpremultiply.
+template <typename T>
+void premultiply_fixed(T *data, size_t pixels, int channels, bool unpremultiply = false) {
+  uint64_t max = fixed_traits<T>::max;
+  for (size_t i = 0; i < pixels; ++i) {
+    T *pixel = data + i * channels;
+    uint64_t alpha = pixel[channels - 1];
+    for (int c = 0; c < channels - 1; ++c) {
+      if (!unpremultiply)
+        pixel[c] = static_cast<T>((pixel[c] * alpha + max / 2) / max);
+      else
+        pixel[c] = alpha == 0 ? 0 : static_cast<T>(std::min(max, (pixel[c] * max + alpha / 2) / alpha));
+    }
+  }
+}
+
+// Fixed-point counterpart of blur_image() for the algorithms that have one;
+// see supports_fixed(). Images with alpha are blurred premultiplied, as
+// blur_image() does.
+template <typename T>
+std::vector<T>
+fixed_blur_image(const T *data, int width, int height, int channels,
+                 const blur_options &options) {
+  int strength = options.strength;
+  size_t pixels = static_cast<size_t>(width) * height;
+
+  std::vector<T> premultiplied;
+  bool premultiply = has_alpha(channels) && !alpha_opaque(data, pixels, channels);
+  if (premultiply) {
+    premultiplied.assign(data, data + pixels * channels);
+    premultiply_fixed(premultiplied.data(), pixels, channels);
+    data = premultiplied.data();
+  }
+
+  std::vector<T> blurred;
+  if (options.algorithm == "box") {
+    std::vector<float> weights = box_weights(strength);
+    blurred = fixed_separable_conv(data, width, height, channels, weights, weights);
+  } else if (options.algorithm == "gaussian") {
+    std::vector<float> weights = gaussian_weights(strength);
+    blurred = fixed_separable_conv(data, width, height, channels, weights, weights);
+  } else {
+    blurred = fixed_sparse_conv(data, width, height, channels,
+                                motion_kernel(strength, options.motion_direction, 1));
+  }
+
+  if (premultiply)
+    premultiply_fixed(blurred.data(), pixels, channels, true);
+  return blurred;
+}
+
+bool supports_fixed(const std::string &algorithm) {
+  return algorithm == "box" || algorithm == "gaussian" || algorithm == "motion";
+}
+
+// Options that blur an image reduced by factor about as much as the original
+// options blur it at full resolution.
+blur_options reduced_options(const blur_options &options, int factor) {
+  blur_options reduced = options;
+  reduced.strength = std::max(1, options.strength / factor);
+  reduced.chroma_strength = std::max(1, options.chroma_strength / factor);
+  reduced.sigma_space = options.sigma_space / factor;
+  return reduced;
+}
+
+// Largest reduction (up to 8) that still leaves REDUCE_MIN_STRENGTH pixels of
+// blur, or that leaves the image no smaller than an output resized down by
+// scale, so the detail lost to reduction is hidden by the blur or the resize.
+int auto_reduce_factor(const blur_options &options, double scale = 1) {
+  int strength = options.ycbcr ? std::min(options.strength, options.chroma_strength) : options.strength;
+  int factor = 1;
+  while (factor < 8 && (strength >= REDUCE_MIN_STRENGTH * factor * 2 || factor * 2 <= scale))
+    factor *= 2;
+  return factor;
+}
+
+bool supports_reduce(const std::string &algorithm) {
+  return algorithm != "custom" && algorithm != "variable";
+}
+
+struct region {
+  int x, y, width, height;
+  bool masked;
+};
+
+bool parse_region(const std::string &spec, int image_width, int image_height, region &roi) {
+  std::istringstream fields(spec);
+  char comma1, comma2, comma3;
+  if (!(fields >> roi.x >> comma1 >> roi.y >> comma2 >> roi.width >> comma3 >> roi.height) ||
+      comma1 != ',' || comma2 != ',' || comma3 != ',' || !fields.eof())
+    return false;
+
+  int right = std::min(roi.x + roi.width, image_width);
+  int bottom = std::min(roi.y + roi.height, image_height);
+  roi.x = std::max(roi.x, 0);
+  roi.y = std::max(roi.y, 0);
+  roi.width = right - roi.x;
+  roi.height = bottom - roi.y;
+  roi.masked = false;
+
+  return roi.width > 0 && roi.height > 0;
+}
+
+// Covers the non-zero part of a mask with rectangles built from runs of
+// MASK_TILE sized tiles, so that large unmasked areas are never processed.
+std::vector<region> mask_regions(const std::vector<std::vector<float>> &mask) {
+  int height = mask.size();
+  int width = mask[0].size();
+  std::vector<region> regions;
+
+  for (int ty = 0; ty < height; ty += MASK_TILE) {
+    int tile_h = std::min(MASK_TILE, height - ty);
+    int run_start = -1;
+
+    for (int tx = 0; tx < width + MASK_TILE; tx += MASK_TILE) {
+      bool active = false;
+      for (int i = ty; i < ty + tile_h && tx < width && !active; ++i)
+        for (int j = tx; j < std::min(tx + MASK_TILE, width) && !active; ++j)
+          active = mask[i][j] > 0;
+
+      if (active && run_start < 0) {
+        run_start = tx;
+      } else if (!active && run_start >= 0) {
+        regions.push_back({run_start, ty, std::min(tx, width) - run_start, tile_h, true});
+        run_start = -1;
+      }
+    }
+  }
+
+  return regions;
+}
+
+// Blurs only the given regions. Each region is cropped together with its
+// apron, blurred on its own and written back, leaving every other pixel as
+// it was. Masked regions blend the result by the mask value.
+std::vector<std::vector<std::vector<float>>>
+blur_regions(const std::vector<std::vector<std::vector<float>>> &image,
+             const blur_options &options,
+             const std::vector<std::vector<float>> &radius_map,
+             const std::vector<region> &regions,
+             const std::vector<std::vector<float>> &mask) {
+  int Hi = image.size();
+  int Wi = image[0].size();
+  int apron = blur_apron(options);
+
+  std::vector<std::vector<std::vector<float>>> out = image;
+
+  for (const auto &roi : regions) {
+    int top = std::max(roi.y - apron, 0);
+    int left = std::max(roi.x - apron, 0);
+    int bottom = std::min(roi.y + roi.height + apron, Hi);
+    int right = std::min(roi.x + roi.width + apron, Wi);
+
+    std::vector<std::vector<std::vector<float>>> crop(bottom - top);
+    std::vector<std::vector<float>> crop_map;
+    for (int i = top; i < bottom; ++i) {
+      crop[i - top].assign(image[i].begin() + left, image[i].begin() + right);
+      if (!radius_map.empty())
+        crop_map.emplace_back(radius_map[i].begin() + left, radius_map[i].begin() + right);
+    }
+
+    auto blurred = blur_image(crop, options, crop_map);
+
+    for (int i = roi.y; i < roi.y + roi.height; ++i) {
+      for (int j = roi.x; j < roi.x + roi.width; ++j) {
+        const auto &value = blurred[i - top][j - left];
+        if (!roi.masked) {
+          out[i][j] = value;
+          continue;
+        }
+        float weight = mask[i][j];
+        for (size_t c = 0; c < value.size(); ++c)
+          out[i][j][c] = image[i][j][c] + (value[c] - image[i][j][c]) * weight;
+      }
+    }
+  }
+
+  return out;
+}
+
+// Blurs an image read a row at a time by read_row(y, row), in bands of rows
+// that are each blurred with blur_apron() rows of context above and below
+// and handed to write_row(y, row) in order. Only a band and its context are
+// held at once, so memory grows with the width and kernel size but not with
+// the height, and the result is the same as blur_image() on the whole image.
+// Returns false as soon as a callback does.
+bool stream_blur(int height, const blur_options &options,
+                 const std::vector<std::vector<float>> &radius_map,
+                 const std::function<bool(int, std::vector<std::vector<float>> &)> &read_row,
+                 const std::function<bool(int, const std::vector<std::vector<float>> &)> &write_row) {
+  int alignment = blur_alignment(options);
+  int apron = (blur_apron(options) + alignment - 1) / alignment * alignment;
+  int band = (std::max(STREAM_BAND_ROWS, 4 * apron) + alignment - 1) / alignment * alignment;
+
+  std::vector<std::vector<std::vector<float>>> window;
+  int window_top = 0;
+
+  for (int y0 = 0; y0 < height; y0 += band) {
+    int y1 = std::min(y0 + band, height);
+    int top = std::max(y0 - apron, 0);
+    int bottom = std::min(y1 + apron, height);
+
+    window.erase(window.begin(), window.begin() + (top - window_top));
+    window_top = top;
+    for (int y = window_top + window.size(); y < bottom; ++y) {
+      window.emplace_back();
+      if (!read_row(y, window.back()))
+        return false;
+    }
+
+    std::vector<std::vector<float>> window_map;
+    if (!radius_map.empty())
+      window_map.assign(radius_map.begin() + top, radius_map.begin() + bottom);
+
+    auto blurred = blur_image(window, options, window_map);
+    for (int y = y0; y < y1; ++y) {
+      if (!write_row(y, blurred[y - top]))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Adds the files matching pattern to inputs. Patterns with no wildcard are
+// taken as they are; a wildcard that matches nothing is an error.
+bool expand_input(const std::string &pattern, std::vector<std::string> &inputs) {
+  if (pattern.find_first_of("*?[") == std::string::npos) {
+    inputs.push_back(pattern);
+    return true;
+  }
+
+  glob_t matches;
+  if (glob(pattern.c_str(), 0, nullptr, &matches) != 0) {
+    globfree(&matches);
+    return false;
+  }
+  inputs.insert(inputs.end(), matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+  globfree(&matches);
+  return true;
+}
+
+// Adds the input file names listed in a manifest, one per line. Blank lines
+// and lines starting with '#' are skipped.
+bool read_manifest(const std::string &filename, std::vector<std::string> &inputs) {
+  std::ifstream file(filename);
+  if (!file)
+    return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (!line.empty() && line[0] != '#')
+      inputs.push_back(line);
+  }
+  return true;
+}
+
+// Fills in an output name template for the index-th input: {name} is the
+// input file name without directory or extension, {dir} its directory and
+// {index} its position in the batch.
+std::string output_path(const std::string &pattern, const std::string &input, size_t index) {
+  size_t slash = input.find_last_of('/');
+  std::string dir = slash == std::string::npos ? "." : input.substr(0, slash);
+  std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+  name = name.substr(0, name.find_last_of('.'));
+
+  std::string path;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern.compare(i, 6, "{name}") == 0) {
+      path += name;
+      i += 5;
+    } else if (pattern.compare(i, 5, "{dir}") == 0) {
+      path += dir;
+      i += 4;
+    } else if (pattern.compare(i, 7, "{index}") == 0) {
+      path += std::to_string(index);
+      i += 6;
+    } else {
+      path += pattern[i];
+    }
+  }
+  return path;
+}
+
+// Reads fd to end of input into bytes.
+bool read_all(int fd, std::vector<unsigned char> &bytes) {
+  unsigned char chunk[65536];
+  for (;;) {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return false;
+    if (n == 0)
+      return true;
+    bytes.insert(bytes.end(), chunk, chunk + n);
+  }
+}
+
+// The --kernel, --map and --mask files, read and the kernel decomposed once
+// for every image blurred with them.
+struct blur_files {
+  std::vector<std::vector<float>> kernel;
+  std::vector<separable_term> kernel_terms;
+  gray_map map, mask;
+};
+
+// Loads the files named in vm into files. A map is only read for the
+// variable algorithm, which is the only one to use it. Errors are reported
+// on stderr and return 1.
+int load_blur_files(const boost::program_options::variables_map &vm, blur_files &files) {
+  if (vm.count("kernel")) {
+    std::string kernel_name = vm["kernel"].as<std::string>();
+    if (!load_kernel(kernel_name, files.kernel)) {
+      std::cerr << "Error: could not load kernel: " << kernel_name << std::endl;
+      return 1;
+    }
+    files.kernel_terms = separable_terms(files.kernel);
+  }
+
+  if (vm.count("map") && vm.count("algo") && vm["algo"].as<std::string>() == "variable") {
+    std::string map_name = vm["map"].as<std::string>();
+    if (!load_map(map_name, files.map)) {
+      std::cerr << "Error: could not load map: " << map_name << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("mask")) {
+    std::string mask_name = vm["mask"].as<std::string>();
+    if (!load_map(mask_name, files.mask)) {
+      std::cerr << "Error: could not load mask: " << mask_name << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// One image on its way from input to output file. The stages are
+// read_input(), blur_input() and write_output(), run one after another by
+// blur_file() or overlapped across images by blur_pipeline().
+struct image_job {
+  std::string image_name;
+  std::string output_name;
+  // Set for images received rather than read from and written to files;
+  // output_name is then only used in messages.
+  const std::vector<unsigned char> *input_bytes = nullptr;
+  std::vector<unsigned char> *output_bytes = nullptr;
+  // Hold the image piped through stdin or stdout for a name of "-".
+  std::vector<unsigned char> piped_input, piped_output;
+  // The kernel, map and mask named in vm, loaded by the caller.
+  const blur_files *files = nullptr;
+
+  int width = 0, height = 0, channels = 0;
+  int depth = 8;
+  void *image_data = nullptr;
+  bool image_data_owned = true;
+  mapped_image mapped_input;
+
+  std::string extension;
+  int output_depth = 8;
+  bool stream = false;
+  png_options png;
+  jpeg_options jpeg;
+  std::vector<unsigned char> output_image;
+  std::vector<uint16_t> output_image_16;
+  std::vector<float> output_image_hdr;
+  mapped_image mapped_output;
+
+  image_job() = default;
+  image_job(const image_job &) = delete;
+  image_job &operator=(const image_job &) = delete;
+  ~image_job() { release_input(*this); }
+
+  // Frees the decoded samples and unmaps the input file.
+  friend void release_input(image_job &job) {
+    if (job.image_data_owned)
+      stbi_image_free(job.image_data);
+    job.image_data = nullptr;
+    unmap_file(job.mapped_input.file);
+  }
+};
+
+// Decodes, or maps, job.image_name. Errors are reported on stderr and
+// return 1.
+int read_input(image_job &job, const boost::program_options::variables_map &vm) {
+  const std::string &image_name = job.image_name;
+  int &width = job.width, &height = job.height, &channels = job.channels, &depth = job.depth;
+  void *&image_data = job.image_data;
+  bool &image_data_owned = job.image_data_owned;
+  mapped_image &mapped_input = job.mapped_input;
+  bool gray = vm.count("gray") > 0;
+  bool stream = vm.count("stream") > 0;
+
+  // "-" reads the whole image from stdin, which cannot be mapped or
+  // seeked; it is then decoded from memory like a received image.
+  if (image_name == "-" && !job.input_bytes) {
+    if (!read_all(STDIN_FILENO, job.piped_input) || job.piped_input.empty()) {
+      std::cerr << "Error: could not read image from stdin" << std::endl;
+      return 1;
+    }
+    job.input_bytes = &job.piped_input;
+  }
+
+  // Uncompressed input is mapped rather than decoded; when streamed, rows
+  // are read from the mapping as they are needed. stb_image also reads
+  // 16-bit PNM samples in the wrong byte order.
+  const std::vector<unsigned char> *bytes = job.input_bytes;
+  if (bytes ? map_image(*bytes, mapped_input) : map_image(image_name, mapped_input)) {
+    width = mapped_input.width;
+    height = mapped_input.height;
+    channels = mapped_input.channels;
+    depth = mapped_input.depth;
+    if (gray && channels >= 3)
+      channels = has_alpha(channels) ? 2 : 1;
+    if (!stream)
+      image_data = read_mapped_image(mapped_input, gray, image_data_owned);
+  }
+
+  // stb_image decodes from the file, or from memory for received images.
+  const char *name = image_name.c_str();
+  const stbi_uc *buffer = bytes ? bytes->data() : nullptr;
+  int length = bytes ? static_cast<int>(bytes->size()) : 0;
+
+  // stb_image converts to luminance while decoding, keeping any alpha.
+  int desired_channels = 0;
+  if (gray && !mapped_input.file.data &&
+      (buffer ? stbi_info_from_memory(buffer, length, &width, &height, &channels)
+              : stbi_info(name, &width, &height, &channels)))
+    desired_channels = has_alpha(channels) ? 2 : 1;
+
+  if (mapped_input.file.data) {
+    // Already read, or streamed.
+  } else if (buffer ? stbi_is_hdr_from_memory(buffer, length) : stbi_is_hdr(name)) {
+    depth = 32;
+    image_data = buffer ? stbi_loadf_from_memory(buffer, length, &width, &height, &channels, desired_channels)
+                        : stbi_loadf(name, &width, &height, &channels, desired_channels);
+  } else if (buffer ? stbi_is_16_bit_from_memory(buffer, length) : stbi_is_16_bit(name)) {
+    depth = 16;
+    image_data = buffer ? stbi_load_16_from_memory(buffer, length, &width, &height, &channels, desired_channels)
+                        : stbi_load_16(name, &width, &height, &channels, desired_channels);
+  } else {
+    image_data = buffer ? stbi_load_from_memory(buffer, length, &width, &height, &channels, desired_channels)
+                        : stbi_load(name, &width, &height, &channels, desired_channels);
+  }
+
+  if (desired_channels)
+    channels = desired_channels;
+
+  if (image_data == nullptr && !(stream && mapped_input.file.data)) {
+    std::cerr << "Error: could not load image: " << image_name << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+// Validates the options in vm against the input in job and blurs it into
+// job's output buffers, or straight into a mapped output file. The input is
+// released once it has been read. Errors are reported on stderr and return
+// 1.
+int blur_input(image_job &job, const boost::program_options::variables_map &vm) {
+  const std::string &image_name = job.image_name;
+  const std::string &output_name = job.output_name;
+  int &width = job.width, &height = job.height, &channels = job.channels, &depth = job.depth;
+  void *image_data = job.image_data;
+  mapped_image &mapped_input = job.mapped_input;
+  mapped_image &mapped_output = job.mapped_output;
+  bool gray = vm.count("gray") > 0;
+  bool &stream = job.stream;
+  stream = vm.count("stream") > 0;
+  blur_options options;
+  std::string &algorithm = options.algorithm;
+  std::vector<std::vector<float>> radius_map;
+  std::vector<std::vector<float>> mask;
+  std::vector<region> regions;
+
+  std::string &extension = job.extension;
+  // --format overrides the extension; output that is not a file has none
+  // and defaults to PNG.
+  if (vm.count("format"))
+    extension = vm["format"].as<std::string>();
+  else if (job.output_bytes || output_name == "-")
+    extension = "png";
+  else
+    extension = output_name.substr(output_name.find_last_of('.') + 1);
+  if (output_name == "-" && !job.output_bytes)
+    job.output_bytes = &job.piped_output;
+  bool pnm_output_format = extension == "ppm" || extension == "pgm" || extension == "pnm";
+  bool mapped_output_format = pnm_output_format || extension == "pfm" || extension == "raw";
+  int &output_depth = job.output_depth;
+
+  if (extension == "png" || pnm_output_format) {
+    output_depth = depth == 16 ? 16 : 8;
+  } else if (extension == "jpg" || extension == "jpeg") {
+    output_depth = 8;
+  } else if (extension == "hdr" || extension == "pfm") {
+    output_depth = 32;
+  } else if (extension == "raw") {
+    output_depth = depth;
+  } else {
+    std::cerr << "Error: Unsupported output file format. Please use .png, "
+                 ".jpg/.jpeg, .hdr, .ppm/.pgm, .pfm or .raw"
+              << std::endl;
+    return 1;
+  }
+
+  if (vm.count("depth")) {
+    output_depth = vm["depth"].as<int>();
+
+    if ((extension != "png" && !pnm_output_format && extension != "raw") ||
+        (output_depth != 8 && output_depth != 16 && (output_depth != 32 || extension != "raw"))) {
+      std::cerr << "Error: Invalid output depth (valid: 8 or 16 for .png and .ppm/.pgm output, "
+                   "8, 16 or 32 for .raw output)." << std::endl;
+      return 1;
+    }
+  }
+
+  if ((pnm_output_format || extension == "pfm") && has_alpha(channels)) {
+    std::cerr << "Error: ." << extension << " output cannot hold alpha; please use .png or .raw." << std::endl;
+    return 1;
+  }
+
+  if (vm.count("strength"))
+    options.strength = vm["strength"].as<int>();
+
+  if (vm.count("sigma_range"))
+    options.sigma_range = vm["sigma_range"].as<float>();
+
+  if (vm.count("sigma_space"))
+    options.sigma_space = vm["sigma_space"].as<float>();
+
+  if (vm.count("algo"))
+    algorithm = vm["algo"].as<std::string>();
+
+  if (algorithm == "motion") {
+    if (vm.count("direction")) {
+      options.motion_direction = vm["direction"].as<std::string>();
+
+      if (options.motion_direction != "vertical" && options.motion_direction != "horizontal" && options.motion_direction != "diagonal") {
+        std::cerr << "Error: Invalid motion direction (valid: horizontal, vertical, diagonal)." << std::endl;
+        return 1;
+      }
+    } else {
+      std::cerr << "Error: Please specify motion direction (horizontal, vertical, diagonal)." << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("kernel")) {
+    if (vm.count("algo") && algorithm != "custom") {
+      std::cerr << "Error: --kernel can only be used with the custom algorithm." << std::endl;
+      return 1;
+    }
+
+    algorithm = "custom";
+    options.custom_kernel = job.files->kernel;
+    options.custom_terms = job.files->kernel_terms;
+  } else if (algorithm == "custom") {
+    std::cerr << "Error: Please specify a kernel file for the custom algorithm." << std::endl;
+    return 1;
+  }
+
+  if (algorithm == "variable") {
+    if (vm.count("map")) {
+      fit_map(job.files->map, width, height, radius_map);
+    } else {
+      std::cerr << "Error: Please specify a radius map for the variable algorithm." << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("roi")) {
+    for (const auto &spec : vm["roi"].as<std::vector<std::string>>()) {
+      region roi;
+      if (!parse_region(spec, width, height, roi)) {
+        std::cerr << "Error: Invalid region of interest: " << spec << " (expected x,y,w,h inside the image)." << std::endl;
+        return 1;
+      }
+      regions.push_back(roi);
+    }
+  }
+
+  if (vm.count("mask")) {
+    fit_map(job.files->mask, width, height, mask);
+    auto masked = mask_regions(mask);
+    regions.insert(regions.end(), masked.begin(), masked.end());
+  }
+
+  if (vm.count("intermediate")) {
+    std::string format = vm["intermediate"].as<std::string>();
+
+    if (format == "fp16") {
+      // Samples are stored scaled to 0-255, so fp16 overflows above about
+      // 257 in HDR input; bf16 has fp32's range.
+      if (depth == 32) {
+        std::cerr << "Error: --intermediate fp16 cannot hold HDR input (valid: fp32, bf16)." << std::endl;
+        return 1;
+      }
+      options.intermediate = storage_format::fp16;
+    } else if (format == "bf16") {
+      options.intermediate = storage_format::bf16;
+    } else if (format != "fp32") {
+      std::cerr << "Error: Invalid intermediate format (valid: fp32, fp16, bf16)." << std::endl;
+      return 1;
+    }
+  }
+
+  dither_mode dither_type = dither_mode::none;
+
+  if (vm.count("dither")) {
+    std::string mode = vm["dither"].as<std::string>();
+
+    if (mode == "ordered") {
+      dither_type = dither_mode::ordered;
+    } else if (mode == "blue") {
+      dither_type = dither_mode::blue;
+    } else if (mode != "none") {
+      std::cerr << "Error: Invalid dither (valid: none, ordered, blue)." << std::endl;
+      return 1;
+    }
+  }
+
+  options.linear = vm.count("linear") > 0;
+  options.ycbcr = vm.count("ycbcr") > 0;
+  options.chroma_strength = vm.count("chroma_strength") ? vm["chroma_strength"].as<int>() : options.strength;
+  options.chroma_half = vm.count("chroma_half") > 0;
+  options.pyramid = vm.count("no_pyramid") == 0;
+
+  if ((vm.count("chroma_strength") || options.chroma_half) && !options.ycbcr) {
+    std::cerr << "Error: --chroma_strength and --chroma_half require --ycbcr." << std::endl;
+    return 1;
+  }
+
+  if (vm.count("fixed")) {
+    if (!supports_fixed(algorithm)) {
+      std::cerr << "Error: --fixed is only supported by the box, gaussian and motion algorithms." << std::endl;
+      return 1;
+    }
+    if (vm.count("roi") || vm.count("mask")) {
+      std::cerr << "Error: --fixed cannot be combined with --roi or --mask." << std::endl;
+      return 1;
+    }
+    if (depth == 32) {
+      std::cerr << "Error: --fixed does not support HDR input." << std::endl;
+      return 1;
+    }
+    if (options.linear || options.ycbcr) {
+      std::cerr << "Error: --fixed cannot be combined with --linear or --ycbcr." << std::endl;
+      return 1;
+    }
+    options.fixed = true;
+  }
+
+  if (algorithm == "lens" && vm.count("blades")) {
+    options.blades = vm["blades"].as<int>();
+
+    if (options.blades != 0 && options.blades < 3) {
+      std::cerr << "Error: Invalid blade count (valid: 0 for a disc, or 3 and above)." << std::endl;
+      return 1;
+    }
+  }
+
+  png_options &png = job.png;
+  png.threads = vm.count("threads") ? vm["threads"].as<int>() : std::max(1u, std::thread::hardware_concurrency());
+
+  if (png.threads < 1) {
+    std::cerr << "Error: Invalid thread count (valid: 1 and above)." << std::endl;
+    return 1;
+  }
+
+  if (vm.count("compression")) {
+    png.level = vm["compression"].as<int>();
+
+    if (png.level < 0 || png.level > 9) {
+      std::cerr << "Error: Invalid compression level (valid: 0 to 9)." << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("png_filter")) {
+    static const char *filters[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+    std::string filter = vm["png_filter"].as<std::string>();
+    auto found = std::find(std::begin(filters), std::end(filters), filter);
+
+    if (found == std::end(filters)) {
+      std::cerr << "Error: Invalid PNG filter (valid: none, sub, up, average, paeth, adaptive)." << std::endl;
+      return 1;
+    }
+    png.filter = found - std::begin(filters) == 5 ? -1 : found - std::begin(filters);
+  }
+
+  if ((vm.count("compression") || vm.count("png_filter")) && extension != "png") {
+    std::cerr << "Error: --compression and --png_filter only apply to .png output." << std::endl;
+    return 1;
+  }
+
+  jpeg_options &jpeg = job.jpeg;
+  jpeg.threads = png.threads;
+
+  if (vm.count("quality")) {
+    jpeg.quality = vm["quality"].as<int>();
+
+    if (jpeg.quality < 1 || jpeg.quality > 100) {
+      std::cerr << "Error: Invalid JPEG quality (valid: 1 to 100)." << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("subsampling")) {
+    jpeg.subsampling = vm["subsampling"].as<int>();
+
+    if (jpeg.subsampling != 444 && jpeg.subsampling != 422 && jpeg.subsampling != 420) {
+      std::cerr << "Error: Invalid JPEG subsampling (valid: 444, 422, 420)." << std::endl;
+      return 1;
+    }
+  }
+
+  if ((vm.count("quality") || vm.count("subsampling")) && extension != "jpg" && extension != "jpeg") {
+    std::cerr << "Error: --quality and --subsampling only apply to .jpg/.jpeg output." << std::endl;
+    return 1;
+  }
+
+  if (stream && (vm.count("fixed") || vm.count("roi") || vm.count("mask"))) {
+    std::cerr << "Error: --stream cannot be combined with --fixed, --roi or --mask." << std::endl;
+    return 1;
+  }
+
+  int output_width = width, output_height = height;
+  bool resize = vm.count("resize") > 0;
+
+  if (resize) {
+    std::istringstream size(vm["resize"].as<std::string>());
+    char separator = 0;
+    if (!(size >> output_width >> separator >> output_height) || !size.eof() || separator != 'x' ||
+        output_width < 0 || output_height < 0 || output_width + output_height == 0) {
+      std::cerr << "Error: Invalid size (expected WxH, with 0 for either side to keep the aspect ratio)." << std::endl;
+      return 1;
+    }
+    if (output_width == 0)
+      output_width = std::max(1, static_cast<int>(std::lround(static_cast<double>(width) * output_height / height)));
+    if (output_height == 0)
+      output_height = std::max(1, static_cast<int>(std::lround(static_cast<double>(height) * output_width / width)));
+
+    if (stream || vm.count("fixed") || vm.count("roi") || vm.count("mask") || vm.count("keep_reduced")) {
+      std::cerr << "Error: --resize cannot be combined with --stream, --fixed, --roi, --mask or --keep_reduced." << std::endl;
+      return 1;
+    }
+  }
+
+  int reduce = 1;
+
+  if (vm.count("reduce")) {
+    std::string factor = vm["reduce"].as<std::string>();
+
+    if (factor == "auto") {
+      // A resize that shrinks the image hides detail as well as the blur.
+      double scale = std::min(static_cast<double>(width) / output_width,
+                              static_cast<double>(height) / output_height);
+      reduce = auto_reduce_factor(options, scale);
+    } else if (factor == "1" || factor == "2" || factor == "4" || factor == "8") {
+      reduce = std::stoi(factor);
+    } else {
+      std::cerr << "Error: Invalid reduction (valid: auto, 1, 2, 4, 8)." << std::endl;
+      return 1;
+    }
+
+    if (!supports_reduce(algorithm)) {
+      std::cerr << "Error: --reduce is not supported by the custom and variable algorithms." << std::endl;
+      return 1;
+    }
+    if (stream || vm.count("fixed") || vm.count("roi") || vm.count("mask")) {
+      std::cerr << "Error: --reduce cannot be combined with --stream, --fixed, --roi or --mask." << std::endl;
+      return 1;
+    }
+  }
+
+  if (vm.count("keep_reduced") && !vm.count("reduce")) {
+    std::cerr << "Error: --keep_reduced requires --reduce." << std::endl;
+    return 1;
+  }
+
+  if (vm.count("keep_reduced")) {
+    output_width = (width + reduce - 1) / reduce;
+    output_height = (height + reduce - 1) / reduce;
+  }
+
+  std::vector<std::vector<std::vector<float>>> blurred_image;
+  std::vector<unsigned char> &output_image = job.output_image;
+  std::vector<uint16_t> &output_image_16 = job.output_image_16;
+  std::vector<float> &output_image_hdr = job.output_image_hdr;
+  bool opaque = false;
+  if (has_alpha(channels) && !options.fixed && image_data != nullptr) {
+    size_t pixels = static_cast<size_t>(width) * height;
+    if (depth == 32)
+      opaque = alpha_opaque(static_cast<float *>(image_data), pixels, channels);
+    else if (depth == 16)
+      opaque = alpha_opaque(static_cast<uint16_t *>(image_data), pixels, channels);
+    else
+      opaque = alpha_opaque(static_cast<unsigned char *>(image_data), pixels, channels);
+  }
+
+  input_decoding decoding;
+  decoding.linear = options.linear;
+  decoding.premultiply = has_alpha(channels) && !opaque && !options.fixed;
+  decoding.drop_alpha = opaque;
+
+  output_encoding encoding;
+  encoding.linear = options.linear;
+  encoding.premultiplied = decoding.premultiply;
+  encoding.opaque_alpha = opaque;
+  encoding.dither = dither_pattern(dither_type);
+  output_encoding encoding_16 = encoding;
+  encoding_16.scale = 257.0f;
+  output_encoding encoding_hdr = encoding;
+  encoding_hdr.scale = 1.0f / 255;
+  encoding_hdr.dither.clear();
+
+  if (mapped_output_format &&
+      !create_mapped_image(job.output_bytes ? "" : output_name, extension, output_width, output_height,
+                           channels, output_depth, mapped_output)) {
+    std::cerr << "Error: could not write image: " << output_name << std::endl;
+    return 1;
+  }
+
+  if (stream) {
+    if (depth == 32)
+      decoding.scale = 255.0f;
+    else if (depth == 16)
+      decoding.scale = 1.0f / 257;
+
+    size_t row_size = static_cast<size_t>(width) * channels;
+    size_t output_size = mapped_output_format ? 0 : row_size * height;
+    if (output_depth == 32)
+      output_image_hdr.resize(output_size);
+    else if (output_depth == 16)
+      output_image_16.resize(output_size);
+    else
+      output_image.resize(output_size);
+
+    std::vector<unsigned char> scratch;
+    auto read_row = [&](int y, std::vector<std::vector<float>> &row) {
+      const unsigned char *data = mapped_input.file.data
+          ? read_mapped_row(mapped_input, y, gray, scratch)
+          : static_cast<unsigned char *>(image_data) + y * row_size * (depth / 8);
+      if (depth == 32)
+        row = std::move(unflatten_image(reinterpret_cast<const float *>(data), width, 1, channels, decoding)[0]);
+      else if (depth == 16)
+        row = std::move(unflatten_image(reinterpret_cast<const uint16_t *>(data), width, 1, channels, decoding)[0]);
+      else
+        row = std::move(unflatten_image(data, width, 1, channels, decoding)[0]);
+      return true;
+    };
+
+    // Mapped output is quantized straight into the file; other formats are
+    // encoded whole once every row is in.
+    std::vector<float> samples;
+    auto write_row = [&](int y, const std::vector<std::vector<float>> &row) {
+      int row_channels = row[0].size();
+      samples.resize(static_cast<size_t>(width) * row_channels);
+      for (int j = 0; j < width; ++j)
+        std::copy(row[j].begin(), row[j].end(), samples.begin() + j * row_channels);
+
+      unsigned char *dst = mapped_output.file.data ? mapped_row(mapped_output, y) : nullptr;
+      size_t offset = static_cast<size_t>(y) * row_size;
+      if (output_depth == 32)
+        quantize_row(samples.data(), dst ? reinterpret_cast<float *>(dst) : output_image_hdr.data() + offset,
+                     width, row_channels, y, encoding_hdr);
+      else if (output_depth == 16)
+        quantize_row(samples.data(), dst ? reinterpret_cast<uint16_t *>(dst) : output_image_16.data() + offset,
+                     width, row_channels, y, encoding_16);
+      else
+        quantize_row(samples.data(), dst ? dst : output_image.data() + offset,
+                     width, row_channels, y, encoding);
+
+      if (dst && mapped_output.swap)
+        swap_samples(dst, row_size, output_depth / 8);
+      return true;
+    };
+
+    if (!stream_blur(height, options, radius_map, read_row, write_row)) {
+      std::cerr << "Error: could not stream " << image_name << " to " << output_name << std::endl;
+      return 1;
+    }
+  } else if (options.fixed && depth == 8) {
+    output_image = fixed_blur_image(static_cast<unsigned char *>(image_data), width, height, channels, options);
+    if (output_depth != 8)
+      blurred_image = unflatten_image(output_image.data(), width, height, channels);
+  } else if (options.fixed) {
+    output_image_16 = fixed_blur_image(static_cast<uint16_t *>(image_data), width, height, channels, options);
+    if (output_depth != 16)
+      blurred_image = unflatten_image(output_image_16.data(), width, height, channels, {1.0f / 257});
+  } else {
+    std::vector<std::vector<std::vector<float>>> image;
+
+    if (depth == 32) {
+      decoding.scale = 255.0f;
+      image = reduce > 1
+          ? unflatten_reduced(static_cast<float *>(image_data), width, height, channels, reduce, decoding)
+          : unflatten_image(static_cast<float *>(image_data), width, height, channels, decoding);
+    } else if (depth == 16) {
+      decoding.scale = 1.0f / 257;
+      image = reduce > 1
+          ? unflatten_reduced(static_cast<uint16_t *>(image_data), width, height, channels, reduce, decoding)
+          : unflatten_image(static_cast<uint16_t *>(image_data), width, height, channels, decoding);
+    } else {
+      image = reduce > 1
+          ? unflatten_reduced(static_cast<unsigned char *>(image_data), width, height, channels, reduce, decoding)
+          : unflatten_image(static_cast<unsigned char *>(image_data), width, height, channels, decoding);
+    }
+
+    // The blur runs on the reduced image and only the result is brought back
+    // to full size, or resampled to the requested one.
+    if (reduce > 1 && resize) {
+      blurred_image = blur_resized(image, reduced_options(options, reduce), radius_map, output_height, output_width);
+    } else if (reduce > 1) {
+      blurred_image = blur_image(image, reduced_options(options, reduce), radius_map);
+      if (!vm.count("keep_reduced"))
+        blurred_image = upsample_image(blurred_image, height, width, reduce);
+    } else if (resize) {
+      blurred_image = blur_resized(image, options, radius_map, output_height, output_width);
+    } else if (vm.count("roi") || vm.count("mask"))
+      blurred_image = blur_regions(image, options, radius_map, regions, mask);
+    else if (output_depth == 8)
+      output_image = blur_image_quantized<unsigned char>(image, options, radius_map, encoding);
+    else if (output_depth == 16)
+      output_image_16 = blur_image_quantized<uint16_t>(image, options, radius_map, encoding_16);
+    else
+      blurred_image = blur_image(image, options, radius_map);
+  }
+
+  width = output_width;
+  height = output_height;
+
+  if (!blurred_image.empty()) {
+    if (output_depth == 32)
+      output_image_hdr = flatten_image<float>(blurred_image, width, height, encoding_hdr);
+    else if (output_depth == 16)
+      output_image_16 = flatten_image<uint16_t>(blurred_image, width, height, encoding_16);
+    else
+      output_image = flatten_image<unsigned char>(blurred_image, width, height, encoding);
+  }
+
+  release_input(job);
+  return 0;
+}
+
+// stbi_write_func that appends to the std::ostream in context.
+void write_stream(void *context, void *data, int size) {
+  static_cast<std::ostream *>(context)->write(static_cast<const char *>(data), size);
+}
+
+// Encodes job's output buffers to job.output_name, or copies them into the
+// mapped output file. Errors are reported on stderr and return 1.
+int write_output(image_job &job) {
+  const std::string &output_name = job.output_name;
+  const std::string &extension = job.extension;
+  int width = job.width, height = job.height, channels = job.channels;
+  int output_depth = job.output_depth;
+  const std::vector<unsigned char> &output_image = job.output_image;
+  const std::vector<uint16_t> &output_image_16 = job.output_image_16;
+  const std::vector<float> &output_image_hdr = job.output_image_hdr;
+  mapped_image &mapped_output = job.mapped_output;
+  bool stream = job.stream;
+  const png_options &png = job.png;
+  const jpeg_options &jpeg = job.jpeg;
+
+  int written = 1;
+
+  if (mapped_output.file.data) {
+    if (!stream) {
+      const unsigned char *src = output_image.data();
+      if (output_depth == 32)
+        src = reinterpret_cast<const unsigned char *>(output_image_hdr.data());
+      else if (output_depth == 16)
+        src = reinterpret_cast<const unsigned char *>(output_image_16.data());
+
+      size_t row_bytes = mapped_row_bytes(mapped_output);
+      for (int i = 0; i < height; ++i) {
+        unsigned char *row = mapped_row(mapped_output, i);
+        std::memcpy(row, src + i * row_bytes, row_bytes);
+        if (mapped_output.swap)
+          swap_samples(row, row_bytes / (output_depth / 8), output_depth / 8);
+      }
+    }
+    if (job.output_bytes)
+      job.output_bytes->assign(mapped_output.file.data, mapped_output.file.data + mapped_output.file.size);
+    else
+      written = commit_mapped_file(mapped_output.file);
+  } else {
+    // Encoded into memory for output_bytes, otherwise straight to the file.
+    std::ostringstream memory;
+    std::ofstream file;
+    if (!job.output_bytes)
+      file.open(output_name, std::ios::binary);
+    std::ostream &out = job.output_bytes ? static_cast<std::ostream &>(memory) : file;
+
+    if (!out)
+      written = 0;
+    else if (output_depth == 32)
+      written = stbi_write_hdr_to_func(write_stream, &out, width, height, channels,
+                                       output_image_hdr.data()) && out.good();
+    else if (output_depth == 16)
+      written = write_png(out, width, height, channels, output_image_16.data(), png);
+    else if (extension == "png")
+      written = write_png(out, width, height, channels, output_image.data(), png);
+    else
+      written = write_jpg(out, width, height, channels, output_image.data(), jpeg);
+
+    if (written && job.output_bytes) {
+      std::string encoded = memory.str();
+      job.output_bytes->assign(encoded.begin(), encoded.end());
+    }
+  }
+
+  if (written && output_name == "-" && job.output_bytes == &job.piped_output) {
+    std::cout.write(reinterpret_cast<const char *>(job.piped_output.data()), job.piped_output.size());
+    written = static_cast<bool>(std::cout.flush());
+  }
+
+  if (!written) {
+    std::cerr << "Error: could not write image: " << output_name << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+// Blurs image_name into output_name with the options in vm. Errors are
+// reported on stderr and return 1.
+int blur_file(const std::string &image_name, const std::string &output_name,
+              const boost::program_options::variables_map &vm, const blur_files &files) {
+  image_job job;
+  job.image_name = image_name;
+  job.output_name = output_name;
+  job.files = &files;
+
+  if (read_input(job, vm) != 0 || blur_input(job, vm) != 0)
+    return 1;
+  return write_output(job);
+}
+
+// Fixed-capacity queue between pipeline stages. push() blocks while the
+// queue is full and pop() while it is empty; once close() has been called,
+// push() drops its item and returns false, and pop() drains what is left
+// and then returns false.
+template <typename T>
+struct bounded_queue {
+  size_t capacity;
+  size_t max_depth = 0;
+  std::deque<T> items;
+  bool closed = false;
+  std::mutex lock;
+  std::condition_variable changed;
+
+  explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+  bool push(T item) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&] { return items.size() < capacity || closed; });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    max_depth = std::max(max_depth, items.size());
+    changed.notify_all();
+    return true;
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&] { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    changed.notify_all();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    closed = true;
+    changed.notify_all();
+  }
+};
+
+// Time a pipeline stage spent working and waiting on its neighbours.
+struct stage_timing {
+  const char *name;
+  size_t images = 0;
+  double busy = 0;
+  double waiting = 0;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs read_input(), blur_input() and write_output() on a thread each, so
+// that the next image decodes and the previous one encodes while one is
+// blurred. Each stage hands over through a queue of queue_depth images,
+// which bounds how many are held at once. With report, the time each stage
+// spent working and waiting and the deepest each queue got are written to
+// stderr. Returns the number of images that failed. A stage that throws
+// closes the queues around it, so that the others finish, and the exception
+// is rethrown here once they have.
+size_t blur_pipeline(const std::vector<std::pair<std::string, std::string>> &files,
+                     const boost::program_options::variables_map &vm,
+                     const blur_files &loaded, size_t queue_depth, bool report) {
+  using clock = std::chrono::steady_clock;
+  bounded_queue<std::unique_ptr<image_job>> decoded(queue_depth), blurred(queue_depth);
+  stage_timing timings[] = {{"decode"}, {"blur"}, {"encode"}};
+  std::atomic<size_t> failed{0};
+
+  std::future<void> reader = shared_workers().run([&] {
+    try {
+      for (const auto &file : files) {
+        auto start = clock::now();
+        auto job = std::make_unique<image_job>();
+        job->image_name = file.first;
+        job->output_name = file.second;
+        job->files = &loaded;
+        bool ok = read_input(*job, vm) == 0;
+        timings[0].busy += seconds_since(start);
+        if (!ok) {
+          ++failed;
+          continue;
+        }
+        ++timings[0].images;
+
+        start = clock::now();
+        bool pushed = decoded.push(std::move(job));
+        timings[0].waiting += seconds_since(start);
+        if (!pushed)
+          break;
+      }
+    } catch (...) {
+      decoded.close();
+      throw;
+    }
+    decoded.close();
+  });
+
+  std::future<void> filter = shared_workers().run([&] {
+    try {
+      std::unique_ptr<image_job> job;
+      for (auto start = clock::now(); decoded.pop(job); start = clock::now()) {
+        timings[1].waiting += seconds_since(start);
+
+        start = clock::now();
+        bool ok = blur_input(*job, vm) == 0;
+        timings[1].busy += seconds_since(start);
+        if (!ok) {
+          ++failed;
+          continue;
+        }
+        ++timings[1].images;
+
+        start = clock::now();
+        bool pushed = blurred.push(std::move(job));
+        timings[1].waiting += seconds_since(start);
+        if (!pushed)
+          break;
+      }
+    } catch (...) {
+      decoded.close();
+      blurred.close();
+      throw;
+    }
+    decoded.close();
+    blurred.close();
+  });
+
+  try {
+    std::unique_ptr<image_job> job;
+    for (auto start = clock::now(); blurred.pop(job); start = clock::now()) {
+      timings[2].waiting += seconds_since(start);
+
+      start = clock::now();
+      bool ok = write_output(*job) == 0;
+      job.reset();
+      timings[2].busy += seconds_since(start);
+      if (!ok)
+        ++failed;
+      else
+        ++timings[2].images;
+    }
+  } catch (...) {
+    decoded.close();
+    blurred.close();
+    reader.wait();
+    filter.wait();
+    throw;
+  }
+
+  reader.get();
+  filter.get();
+
+  if (report) {
+    size_t depths[] = {decoded.max_depth, blurred.max_depth, 0};
+    for (int i = 0; i < 3; ++i) {
+      std::cerr << timings[i].name << ": " << timings[i].images << " images, "
+                << timings[i].busy << " s working, " << timings[i].waiting << " s waiting";
+      if (i < 2)
+        std::cerr << ", queue depth " << depths[i] << "/" << queue_depth;
+      std::cerr << std::endl;
+    }
+  }
+
+  return failed;
+}
+
+// Reads a line from fd, without its '\n'. Fails at end of input or once
+// the line is longer than SERVE_MAX_LINE.
+bool read_line(int fd, std::string &line) {
+  line.clear();
+  char c;
+  for (;;) {
+    ssize_t n = read(fd, &c, 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0 || line.size() >= SERVE_MAX_LINE)
+      return false;
+    if (c == '\n')
+      return true;
+    line += c;
+  }
+}
+
+bool read_exact(int fd, unsigned char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Sends what is written to it into the calling thread's capture string
+// when it has one and to the original buffer otherwise, so that the error
+// messages of requests blurred at the same time stay apart.
+struct capture_buffer : std::streambuf {
+  std::streambuf *original;
+  std::mutex lock;
+  static inline thread_local std::string *target = nullptr;
+
+  explicit capture_buffer(std::streambuf *original) : original(original) {}
+
+protected:
+  int overflow(int c) override {
+    if (c != traits_type::eof()) {
+      char byte = traits_type::to_char_type(c);
+      xsputn(&byte, 1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    if (target != nullptr) {
+      target->append(data, size);
+      return size;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    return original->sputn(data, size);
+  }
+
+  int sync() override {
+    if (target != nullptr)
+      return 0;
+    std::lock_guard<std::mutex> guard(lock);
+    return original->pubsync();
+  }
+};
+
+const char *priority_names[] = {"interactive", "bulk"};
+
+// A request from a client, from the moment it is received until its reply
+// is ready.
+struct serve_request {
+  boost::program_options::variables_map vm;
+  std::vector<unsigned char> input;
+  std::vector<unsigned char> output;
+  std::string error;
+  bool ok = false;
+  int priority = 0;
+  size_t memory = 0;
+  std::chrono::steady_clock::time_point received;
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+  std::promise<void> done;
+};
+
+// Rough peak memory of blurring a width x height image: the float image,
+// with a vector per pixel, is held about three times over (input, result
+// and scratch).
+size_t estimated_memory(int width, int height, int channels) {
+  size_t pixel = sizeof(std::vector<float>) + channels * sizeof(float) + 16;
+  return static_cast<size_t>(width) * height * pixel * 3;
+}
+
+// Reads an image's size from its header without decoding it.
+bool image_info(const std::vector<unsigned char> &bytes, int &width, int &height, int &channels) {
+  if (stbi_info_from_memory(bytes.data(), bytes.size(), &width, &height, &channels))
+    return true;
+
+  mapped_image image;
+  if (!map_image(bytes, image))
+    return false;
+  width = image.width;
+  height = image.height;
+  channels = image.channels;
+  return true;
+}
+
+// Parses a request's options into request.vm. args holds the options for
+// this image only; the options the server was started with, in defaults,
+// fill in the rest. Returns false with request.error set if they are not
+// valid for a request.
+bool parse_request(const std::string &args, serve_request &request,
+                   const boost::program_options::options_description &desc,
+                   const boost::program_options::parsed_options &defaults) {
+  std::vector<std::string> words;
+  std::istringstream split(args);
+  for (std::string word; split >> word;)
+    words.push_back(word);
+
+  boost::program_options::variables_map &vm = request.vm;
+  try {
+    boost::program_options::store(
+        boost::program_options::command_line_parser(words).options(desc).run(), vm);
+  } catch (const boost::program_options::error &e) {
+    request.error = e.what();
+    return false;
+  }
+
+  // Requests name no files, so a client cannot read or write the server's,
+  // or learn which exist, and cannot lift the server's limits.
+  for (const char *name : {"input", "manifest", "output", "kernel", "map", "mask", "serve",
+                           "memory_budget"}) {
+    if (vm.count(name)) {
+      request.error = std::string("--") + name + " cannot be given in a request";
+      return false;
+    }
+  }
+
+  // Values already stored are kept, so the request's own take precedence.
+  boost::program_options::store(defaults, vm);
+
+  if (vm.count("priority")) {
+    std::string priority = vm["priority"].as<std::string>();
+    auto found = std::find(std::begin(priority_names), std::end(priority_names), priority);
+    if (found == std::end(priority_names)) {
+      request.error = "Invalid priority (valid: interactive, bulk).";
+      return false;
+    }
+    request.priority = found - std::begin(priority_names);
+  }
+
+  if (vm.count("deadline")) {
+    int milliseconds = vm["deadline"].as<int>();
+    if (milliseconds < 1) {
+      request.error = "Invalid deadline (valid: 1 ms and above).";
+      return false;
+    }
+    request.deadline = request.received + std::chrono::milliseconds(milliseconds);
+  }
+
+  // An image whose size cannot be read would escape the memory budget.
+  int width, height, channels;
+  if (!vm.count("stats")) {
+    if (!image_info(request.input, width, height, channels)) {
+      request.error = "could not load image: request";
+      return false;
+    }
+    request.memory = estimated_memory(width, height, channels);
+  }
+  return true;
+}
+
+// Blurs request.input into request.output in the format named by --format
+// (default: png), encoding with at most threads threads, with the kernel,
+// map and mask the server was started with. On failure request.error holds
+// the message that blur_file() would have printed.
+void blur_request(serve_request &request, int threads, const blur_files &files) {
+  const boost::program_options::variables_map &vm = request.vm;
+  image_job job;
+  job.image_name = "request";
+  job.output_name = "response";
+  job.input_bytes = &request.input;
+  job.output_bytes = &request.output;
+  job.files = &files;
+
+  std::string messages;
+  capture_buffer::target = &messages;
+  request.ok = read_input(job, vm) == 0 && blur_input(job, vm) == 0;
+  if (request.ok) {
+    job.png.threads = std::min(job.png.threads, threads);
+    job.jpeg.threads = std::min(job.jpeg.threads, threads);
+    request.ok = write_output(job) == 0;
+  }
+  capture_buffer::target = nullptr;
+
+  if (!request.ok) {
+    std::string line;
+    for (std::istringstream lines(messages); std::getline(lines, line);) {
+      if (!line.empty())
+        request.error = line.compare(0, 7, "Error: ") == 0 ? line.substr(7) : line;
+    }
+  }
+}
+
+// Blurs queued requests in batches, interactive ones before bulk. A batch is
+// one request blurred with every thread, or up to threads small requests
+// (input up to SERVE_BATCH_BYTES) of the same priority blurred side by side
+// with a thread each, since images that small barely split across cores.
+// The memory estimates of a batch stay within memory_budget (0 for no
+// limit). A request that alone exceeds it, or whose deadline passes while
+// it waits, is answered with an error without being blurred. The input
+// bytes of requests being answered are held within memory_budget as well.
+struct scheduler {
+  int threads;
+  size_t memory_budget;
+  const blur_files &files;
+  size_t held_input = 0;
+  bool stopping = false;
+  std::mutex lock;
+  std::condition_variable ready;
+  std::condition_variable released;
+  std::deque<std::shared_ptr<serve_request>> queues[2];
+
+  // Counters for stats(), guarded by lock. latency[p][i] counts requests of
+  // priority p answered within 2^i ms; the last bucket counts the rest.
+  size_t completed[2] = {};
+  size_t failed = 0;
+  size_t expired = 0;
+  size_t over_budget = 0;
+  size_t batches = 0;
+  size_t batched = 0;
+  size_t latency[2][SERVE_LATENCY_BUCKETS + 1] = {};
+
+  scheduler(int threads, size_t memory_budget, const blur_files &files)
+      : threads(threads), memory_budget(memory_budget), files(files) {}
+
+  // Reserves size bytes of input before they are read, waiting for other
+  // requests to be answered if they do not fit yet. Fails if they could
+  // never fit.
+  bool admit(size_t size) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (memory_budget > 0 && size > memory_budget)
+      return false;
+    released.wait(guard, [&] { return memory_budget == 0 || held_input + size <= memory_budget; });
+    held_input += size;
+    return true;
+  }
+
+  void release(size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    held_input -= size;
+    released.notify_all();
+  }
+
+  void submit(const std::shared_ptr<serve_request> &request) {
+    std::lock_guard<std::mutex> guard(lock);
+    queues[request->priority].push_back(request);
+    ready.notify_one();
+  }
+
+  // Makes run() return once the queues are empty.
+  void stop() {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    ready.notify_all();
+  }
+
+  // Takes the next batch off the queues, answering the requests that are
+  // rejected along the way. Returns false once stopped with nothing queued.
+  bool next_batch(std::vector<std::shared_ptr<serve_request>> &batch) {
+    std::vector<std::shared_ptr<serve_request>> rejected;
+    std::unique_lock<std::mutex> guard(lock);
+    ready.wait(guard, [&] { return stopping || !queues[0].empty() || !queues[1].empty(); });
+    if (queues[0].empty() && queues[1].empty())
+      return false;
+
+    auto &queue = queues[0].empty() ? queues[1] : queues[0];
+    auto now = std::chrono::steady_clock::now();
+    size_t memory = 0;
+    while (!queue.empty() && static_cast<int>(batch.size()) < threads) {
+      std::shared_ptr<serve_request> request = queue.front();
+      bool small = request->input.size() <= SERVE_BATCH_BYTES;
+
+      if (now > request->deadline) {
+        request->error = "deadline passed before the request was blurred";
+        ++expired;
+      } else if (memory_budget > 0 && request->memory > memory_budget) {
+        request->error = "image needs about " + std::to_string(request->memory >> 20) +
+                         " MB, over the memory budget of " + std::to_string(memory_budget >> 20) + " MB";
+        ++over_budget;
+      } else if (!batch.empty() &&
+                 (!small || (memory_budget > 0 && memory + request->memory > memory_budget))) {
+        break;
+      } else {
+        batch.push_back(request);
+        memory += request->memory;
+        queue.pop_front();
+        if (!small)
+          break;
+        continue;
+      }
+      rejected.push_back(request);
+      queue.pop_front();
+    }
+
+    if (!batch.empty()) {
+      ++batches;
+      batched += batch.size();
+    }
+    guard.unlock();
+
+    for (auto &request : rejected)
+      request->done.set_value();
+    return true;
+  }
+
+  void finish(serve_request &request) {
+    double milliseconds = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - request.received).count();
+    int bucket = 0;
+    while (bucket < SERVE_LATENCY_BUCKETS && milliseconds > (1 << bucket))
+      ++bucket;
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      ++latency[request.priority][bucket];
+      if (request.ok)
+        ++completed[request.priority];
+      else
+        ++failed;
+    }
+    request.done.set_value();
+  }
+
+  // Runs batches until stop() is called.
+  void run() {
+    for (std::vector<std::shared_ptr<serve_request>> batch; next_batch(batch); batch.clear()) {
+      if (batch.empty())
+        continue;
+      if (batch.size() == 1)
+        blur_request(*batch[0], threads, files);
+      else
+        parallel_for(batch.size(), threads, [&](int i) { blur_request(*batch[i], 1, files); });
+
+      for (auto &request : batch)
+        finish(*request);
+    }
+  }
+
+  // Queue lengths, counters and latency histograms, a line each.
+  std::string stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::ostringstream text;
+    for (int p = 0; p < 2; ++p)
+      text << "queued " << priority_names[p] << " " << queues[p].size() << "\n";
+    for (int p = 0; p < 2; ++p)
+      text << "completed " << priority_names[p] << " " << completed[p] << "\n";
+    text << "failed " << failed << "\n"
+         << "expired " << expired << "\n"
+         << "over_budget " << over_budget << "\n"
+         << "batches " << batches << " images " << batched << "\n";
+    for (int p = 0; p < 2; ++p) {
+      text << "latency_ms " << priority_names[p];
+      for (int i = 0; i < SERVE_LATENCY_BUCKETS; ++i)
+        text << " " << (1 << i) << ":" << latency[p][i];
+      text << " inf:" << latency[p][SERVE_LATENCY_BUCKETS] << "\n";
+    }
+    return text.str();
+  }
+};
+
+// Answers requests on one connection until the client closes it or sends
+// something malformed. Requests on one connection are answered in order;
+// other connections are served meanwhile. The caller closes fd.
+void serve_client(int fd, scheduler &requests,
+                  const boost::program_options::options_description &desc,
+                  const boost::program_options::parsed_options &defaults) {
+  std::string args, count;
+  while (read_line(fd, args) && read_line(fd, count)) {
+    char *end = nullptr;
+    unsigned long long size = std::strtoull(count.c_str(), &end, 10);
+    if (count.empty() || *end != '\0' || size > SERVE_MAX_INPUT_BYTES) {
+      std::string reply = "ERROR invalid byte count\n";
+      write_all(fd, reply.data(), reply.size());
+      break;
+    }
+    if (!requests.admit(size)) {
+      std::string reply = "ERROR image of " + std::to_string(size >> 20) +
+                          " MB is over the memory budget of " + std::to_string(requests.memory_budget >> 20) + " MB\n";
+      write_all(fd, reply.data(), reply.size());
+      break;
+    }
+
+    auto request = std::make_shared<serve_request>();
+    request->received = std::chrono::steady_clock::now();
+    request->input.resize(size);
+    if (!read_exact(fd, request->input.data(), size)) {
+      requests.release(size);
+      break;
+    }
+
+    if (!parse_request(args, *request, desc, defaults)) {
+      request->ok = false;
+    } else if (request->vm.count("stats")) {
+      std::string text = requests.stats();
+      request->output.assign(text.begin(), text.end());
+      request->ok = true;
+    } else {
+      auto done = request->done.get_future();
+      requests.submit(request);
+      done.wait();
+    }
+
+    request->input.clear();
+    request->input.shrink_to_fit();
+    requests.release(size);
+
+    std::string header = request->ok ? "OK " + std::to_string(request->output.size()) + "\n"
+                                     : "ERROR " + request->error + "\n";
+    if (!write_all(fd, header.data(), header.size()) ||
+        (request->ok && !write_all(fd, request->output.data(), request->output.size())))
+      break;
+  }
+}
+
+// A connection served on a thread of its own. fd stays open until the
+// thread has been joined, so that shutdown() cannot reach a reused fd.
+struct client_thread {
+  int fd;
+  std::atomic<bool> finished{false};
+  std::thread thread;
+};
+
+// Serves blur requests on a Unix domain socket at path until accepting a
+// connection fails. Each request is a line of options, a line with the size of
+// the image in bytes, and the image itself; the reply is "OK <size>" and the
+// blurred image, or "ERROR <message>", each on a line of its own. A
+// connection may carry any number of requests, and each connection is read
+// on a thread of its own while one scheduler does the blurring.
+int serve(const std::string &path, const boost::program_options::variables_map &vm,
+          const boost::program_options::options_description &desc,
+          const boost::program_options::parsed_options &defaults) {
+  int threads = vm.count("threads") ? vm["threads"].as<int>() : std::max(1u, std::thread::hardware_concurrency());
+  int budget = vm.count("memory_budget") ? vm["memory_budget"].as<int>() : 0;
+  if (threads < 1 || budget < 0) {
+    std::cerr << "Error: Invalid thread count or memory budget (valid: 1 thread and above, 0 MB and above)." << std::endl;
+    return 1;
+  }
+
+  blur_files loaded;
+  if (load_blur_files(vm, loaded) != 0)
+    return 1;
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: socket path is too long: " << path << std::endl;
+    return 1;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  // A socket left behind by an earlier server is replaced.
+  struct stat info;
+  if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    unlink(path.c_str());
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0 || bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+      listen(server, SOMAXCONN) != 0) {
+    std::cerr << "Error: could not listen on: " << path << std::endl;
+    if (server >= 0)
+      close(server);
+    return 1;
+  }
+
+  static capture_buffer capture(std::cerr.rdbuf());
+  std::cerr.rdbuf(&capture);
+
+  scheduler requests(threads, static_cast<size_t>(budget) << 20, loaded);
+  std::future<void> blurring = shared_workers().run([&requests] { requests.run(); });
+
+  // Kept in a list so that a running thread's entry does not move.
+  std::list<client_thread> clients;
+  auto reap = [&clients](bool all) {
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (all || it->finished) {
+        it->thread.join();
+        close(it->fd);
+        it = clients.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  };
+
+  for (;;) {
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      std::cerr << "Error: could not accept connection on: " << path << std::endl;
+      break;
+    }
+
+    reap(false);
+    if (clients.size() >= SERVE_MAX_CLIENTS) {
+      std::string reply = "ERROR too many connections\n";
+      write_all(client, reply.data(), reply.size());
+      close(client);
+      continue;
+    }
+
+    clients.emplace_back();
+    client_thread &connection = clients.back();
+    connection.fd = client;
+    connection.thread = std::thread([&connection, &requests, &desc, &defaults] {
+      serve_client(connection.fd, requests, desc, defaults);
+      connection.finished = true;
+    });
+  }
+
+  // Connections are cut off, letting the requests they already sent finish,
+  // and every thread is joined before requests, desc and defaults go away.
+  close(server);
+  for (auto &connection : clients)
+    shutdown(connection.fd, SHUT_RDWR);
+  reap(true);
+  requests.stop();
+  blurring.get();
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+      ("input,i", boost::program_options::value<std::vector<std::string>>()->composing(), "set input file name, quoted glob or - for stdin (may be repeated, or given as arguments)")
+      ("manifest", boost::program_options::value<std::string>(), "read input file names from a file, one per line")
+      ("output,o", boost::program_options::value<std::string>(), "set output file name, - for stdout, or a template with {name}, {dir} and {index} for several inputs")
+      ("algo,a", boost::program_options::value<std::string>(), "set algorithm (default: gaussian)")
+      ("strength,s", boost::program_options::value<int>(), "set blur strength (default: 3)")
+      ("sigma_range,sr", boost::program_options::value<float>(), "set sigma range for bilateral blur (default: 50.0)")
+      ("sigma_space,sp", boost::program_options::value<float>(), "set sigma space for bilateral blur (default: 2.0)")
+      ("direction,d", boost::program_options::value<std::string>(), "set direction for motion blur")
+      ("kernel,k", boost::program_options::value<std::string>(), "load a custom convolution kernel from file")
+      ("map,m", boost::program_options::value<std::string>(), "set grayscale radius map for variable blur")
+      ("roi,r", boost::program_options::value<std::vector<std::string>>()->composing(), "only blur the region x,y,w,h (may be repeated)")
+      ("mask", boost::program_options::value<std::string>(), "only blur where the grayscale mask is non-zero")
+      ("fixed", "process 8-bit samples in fixed point (box, gaussian and motion only)")
+      ("depth", boost::program_options::value<int>(), "set output bit depth: 8 or 16, or 32 for raw (default: input depth)")
+      ("intermediate", boost::program_options::value<std::string>(), "set storage between separable passes: fp32, fp16 or bf16 (default: fp32)")
+      ("dither", boost::program_options::value<std::string>(), "set dither for integer output: none, ordered or blue (default: none)")
+      ("linear", "blur in linear light instead of on sRGB-encoded values")
+      ("gray", "convert to grayscale and blur a single luminance plane")
+      ("ycbcr", "blur luma and chroma separately in YCbCr")
+      ("chroma_strength", boost::program_options::value<int>(), "set chroma blur strength in YCbCr mode (default: strength)")
+      ("chroma_half", "blur chroma at half resolution in YCbCr mode")
+      ("blades,b", boost::program_options::value<int>(), "set aperture blade count for lens blur (default: 0, circular)")
+      ("no_pyramid", "blur large gaussians at full resolution instead of through an image pyramid")
+      ("resize", boost::program_options::value<std::string>(), "resize the output to WxH, fused with the blur (0 for either side keeps the aspect ratio)")
+      ("reduce", boost::program_options::value<std::string>(), "blur at 1/2, 1/4 or 1/8 resolution: auto, 1, 2, 4, 8 (default: 1)")
+      ("keep_reduced", "write the reduced-resolution result instead of upsampling it")
+      ("stream", "blur in bands of rows to bound memory on very large images")
+      ("compression", boost::program_options::value<int>(), "set PNG compression level: 0 (stored) to 9, where 1 to 5 compress alike (default: 8)")
+      ("png_filter", boost::program_options::value<std::string>(), "set PNG row filter: none, sub, up, average, paeth or adaptive (default: adaptive)")
+      ("quality", boost::program_options::value<int>(), "set JPEG quality: 1 to 100 (default: 100)")
+      ("subsampling", boost::program_options::value<int>(), "set JPEG chroma subsampling: 444, 422 or 420 (default: 420 up to quality 90, 444 above)")
+      ("threads", boost::program_options::value<int>(), "set number of threads for encoding (default: all cores)")
+      ("queue_depth", boost::program_options::value<int>(), "set number of images queued between the decode, blur and encode stages (default: 2)")
+      ("timings", "report the time each stage spent working and waiting")
+      ("serve", boost::program_options::value<std::string>(), "serve blur requests on a Unix domain socket at the given path")
+      ("format", boost::program_options::value<std::string>(), "set output format instead of taking it from the output extension: png, jpg, hdr, ppm, pgm, pfm or raw (default: png for stdout and --serve requests)")
+      ("priority", boost::program_options::value<std::string>(), "set priority of a --serve request: interactive or bulk (default: interactive)")
+      ("deadline", boost::program_options::value<int>(), "fail a --serve request not started within this many milliseconds")
+      ("memory_budget", boost::program_options::value<int>(), "limit the estimated memory of images blurred at once by --serve, in MB (default: 0, no limit)")
+      ("stats", "reply to a --serve request with queue lengths, counters and latency histograms")
+      ("help,h", "display usage message");
+
+  if (argc == 1) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  boost::program_options::positional_options_description positional;
+  positional.add("input", -1);
+
+  boost::program_options::parsed_options parsed =
+      boost::program_options::command_line_parser(argc, argv).options(desc).positional(positional).run();
+  boost::program_options::variables_map vm;
+  boost::program_options::store(parsed, vm);
+  boost::program_options::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << desc << "\n";
+    return 0;
+  }
+
+  // An invalid count is reported where the images are blurred.
+  if (vm.count("threads") && vm["threads"].as<int>() > 0)
+    shared_workers().set_limit(vm["threads"].as<int>());
+
+  if (vm.count("serve")) {
+    if (vm.count("input") || vm.count("manifest") || vm.count("output")) {
+      std::cerr << "Error: --serve takes images from requests, not from --input, --manifest or --output." << std::endl;
+      return 1;
+    }
+    return serve(vm["serve"].as<std::string>(), vm, desc, parsed);
+  }
+
+  std::vector<std::string> inputs;
+
+  if (vm.count("input")) {
+    for (const auto &pattern : vm["input"].as<std::vector<std::string>>()) {
+      if (!expand_input(pattern, inputs)) {
+        std::cerr << "Error: no input matches: " << pattern << std::endl;
+        return 1;
+      }
+    }
+  }
+
+  if (vm.count("manifest")) {
+    std::string manifest_name = vm["manifest"].as<std::string>();
+    if (!read_manifest(manifest_name, inputs)) {
+      std::cerr << "Error: could not read manifest: " << manifest_name << std::endl;
+      return 1;
+    }
+  }
+
+  if (inputs.empty()) {
+    std::cerr << "Error: please specify input image" << std::endl;
+    return 1;
+  }
+
+  if (!vm.count("output")) {
+    std::cerr << "Error: please specify output path: " << inputs[0] << std::endl;
+    return 1;
+  }
+
+  std::string output = vm["output"].as<std::string>();
+
+  if (std::count(inputs.begin(), inputs.end(), "-") > 1) {
+    std::cerr << "Error: stdin (-) can only be given as input once." << std::endl;
+    return 1;
+  }
+
+  if (inputs.size() > 1 && output.find("{name}") == std::string::npos &&
+      output.find("{index}") == std::string::npos) {
+    std::cerr << "Error: --output must contain {name} or {index} when there are several inputs." << std::endl;
+    return 1;
+  }
+
+  int queue_depth = vm.count("queue_depth") ? vm["queue_depth"].as<int>() : DEFAULT_QUEUE_DEPTH;
+
+  if (queue_depth < 1) {
+    std::cerr << "Error: Invalid queue depth (valid: 1 and above)." << std::endl;
+    return 1;
+  }
+
+  blur_files loaded;
+  if (load_blur_files(vm, loaded) != 0)
+    return 1;
+
+  // A failed image is reported and the rest of the batch still runs.
+  size_t failed = 0;
+  if (inputs.size() > 1 || vm.count("timings")) {
+    std::vector<std::pair<std::string, std::string>> files;
+    for (size_t i = 0; i < inputs.size(); ++i)
+      files.emplace_back(inputs[i], output_path(output, inputs[i], i));
+    failed = blur_pipeline(files, vm, loaded, queue_depth, vm.count("timings") > 0);
+  } else if (blur_file(inputs[0], output_path(output, inputs[0], 0), vm, loaded) != 0) {
+    failed = 1;
+  }
+
+  if (failed > 0 && inputs.size() > 1)
+    std::cerr << "Error: " << failed << " of " << inputs.size() << " images failed." << std::endl;
+
+  return failed > 0 ? 1 : 0;
 }
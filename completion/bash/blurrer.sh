@@ -11,10 +11,10 @@ _image_processing_completions() {
     prev="${COMP_WORDS[COMP_CWORD-1]}"
 
     # Options available for the user
-    opts="-i --input -o --output -a --algo -s --strength --sr --sigma_range --sp --sigma_space -d --direction -h --help"
+    opts="-i --input --manifest -o --output -a --algo -s --strength --sr --sigma_range --sp --sigma_space -d --direction -k --kernel -m --map -r --roi --mask --fixed --depth --intermediate --dither --linear --gray --ycbcr --chroma_strength --chroma_half -b --blades --no_pyramid --resize --reduce --keep_reduced --stream --compression --png_filter --quality --subsampling --threads --queue_depth --timings --serve --format --priority --deadline --memory_budget --stats -h --help"
 
     # Available algorithms
-    algorithms="gaussian box bilateral median motion"
+    algorithms="gaussian box bilateral median motion lens custom variable"
 
     # Available directions for motion blur
     directions="horizontal vertical diagonal"
@@ -31,6 +31,36 @@ _image_processing_completions() {
         return 0
     fi
 
+    # Completing the reduction factors after --reduce
+    if [[ ${prev} == "--reduce" ]] ; then
+        COMPREPLY=( $(compgen -W "auto 1 2 4 8" -- ${cur}) )
+        return 0
+    fi
+
+    # Completing the output formats after --format
+    if [[ ${prev} == "--format" ]] ; then
+        COMPREPLY=( $(compgen -W "png jpg hdr ppm pgm pfm raw" -- ${cur}) )
+        return 0
+    fi
+
+    # Completing the request priorities after --priority
+    if [[ ${prev} == "--priority" ]] ; then
+        COMPREPLY=( $(compgen -W "interactive bulk" -- ${cur}) )
+        return 0
+    fi
+
+    # Completing the PNG filters after --png_filter
+    if [[ ${prev} == "--png_filter" ]] ; then
+        COMPREPLY=( $(compgen -W "none sub up average paeth adaptive" -- ${cur}) )
+        return 0
+    fi
+
+    # Completing the JPEG subsampling modes after --subsampling
+    if [[ ${prev} == "--subsampling" ]] ; then
+        COMPREPLY=( $(compgen -W "444 422 420" -- ${cur}) )
+        return 0
+    fi
+
     # Completing the directions after -d or --direction
     if [[ ${prev} == "-d" || ${prev} == "--direction" ]] ; then
         COMPREPLY=( $(compgen -W "${directions}" -- ${cur}) )
@@ -0,0 +1,83 @@
+// Checks that fp16 and bf16 storage between separable passes stays within
+// their rounding error of fp32: half an ulp per stored sample, which is
+// 2^-11 of the value for fp16 and 2^-8 for bf16. Run with make test.
+
+#define main blurrer_main
+#include "../blurrer.cpp"
+#undef main
+
+#include <random>
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Round trips a row through T and returns the largest error relative to the
+// value. The row length leaves a tail after the eight-sample F16C blocks.
+template <typename T>
+double row_error(const std::vector<float> &row) {
+  std::vector<T> stored(row.size());
+  std::vector<float> loaded(row.size());
+  store_row(row.data(), stored.data(), row.size());
+  load_row(stored.data(), loaded.data(), row.size());
+
+  double worst = 0;
+  for (size_t x = 0; x < row.size(); ++x)
+    worst = std::max(worst, std::abs(static_cast<double>(loaded[x]) - row[x]) / row[x]);
+  return worst;
+}
+
+// Largest difference between a gaussian blur through T and through fp32.
+double blur_error(const std::vector<std::vector<std::vector<float>>> &image,
+                  storage_format intermediate) {
+  std::vector<float> weights = gaussian_weights(9);
+  auto exact = separable_conv(image, weights, weights);
+  auto stored = separable_conv(image, weights, weights, intermediate);
+
+  double worst = 0;
+  for (size_t i = 0; i < image.size(); ++i)
+    for (size_t j = 0; j < image[i].size(); ++j)
+      for (size_t c = 0; c < image[i][j].size(); ++c)
+        worst = std::max(worst, std::abs(static_cast<double>(stored[i][j][c]) - exact[i][j][c]));
+  return worst;
+}
+
+int main() {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> sample(1.0f / 16, 255);
+
+  std::vector<float> row(1003);
+  for (float &value : row)
+    value = sample(random);
+
+  check(row_error<float16>(row) <= std::ldexp(1.0, -11), "fp16 row round trip");
+  check(row_error<bfloat16>(row) <= std::ldexp(1.0, -8), "bf16 row round trip");
+
+  // The scalar conversion must match F16C where the CPU has it.
+  std::vector<float16> vector_row(row.size());
+  store_row(row.data(), vector_row.data(), row.size());
+  bool same = true;
+  for (size_t x = 0; x < row.size(); ++x)
+    same = same && vector_row[x].bits == float_to_half(row[x]);
+  check(same, "fp16 F16C and scalar conversions agree");
+
+  std::vector<std::vector<std::vector<float>>> image(
+      61, std::vector<std::vector<float>>(83, std::vector<float>(3)));
+  for (auto &line : image)
+    for (auto &pixel : line)
+      for (float &value : pixel)
+        value = sample(random);
+
+  // Every stored sample is at most 255, and the second pass has unit gain.
+  check(blur_error(image, storage_format::fp16) <= 255 * std::ldexp(1.0, -11), "fp16 blur");
+  check(blur_error(image, storage_format::bf16) <= 255 * std::ldexp(1.0, -8), "bf16 blur");
+
+  if (failures == 0)
+    std::cout << "intermediate: all checks passed" << (has_f16c() ? " (F16C)" : "") << std::endl;
+  return failures == 0 ? 0 : 1;
+}